@@ -1,206 +1,529 @@
 #include "exfs2.h"
+#include <sys/stat.h>
 
-#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))  // Number of uint32_t pointers per block
+#define ADD_CHUNK_SIZE ((size_t)BLOCKS_PER_SEGMENT * BLOCK_SIZE)   // Input read per chunk (1MB)
+#define ZERO_SCAN_STRIDE 256                                        // Bytes OR-ed before each early exit
+
+typedef uint64_t ZeroScanLanes __attribute__((vector_size(32)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define ZERO_SCAN_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define ZERO_SCAN_CLONES
+#endif
+
+// Block-pointer map built while the file streams in: only the pointer blocks
+// currently being filled are kept in memory, finished ones are written out
+typedef struct {
+    Inode *inode;
+    uint32_t blocks;                      // File blocks mapped so far
+    uint32_t single[PTRS_PER_BLOCK];      // Single indirect block being filled
+    uint32_t top[PTRS_PER_BLOCK];         // Double indirect top level
+    uint32_t leaf[PTRS_PER_BLOCK];        // Double or triple indirect leaf being filled
+    uint32_t triple[PTRS_PER_BLOCK];      // Triple indirect top level
+    uint32_t mid[PTRS_PER_BLOCK];         // Triple indirect middle level being filled
+} BlockMap;
+
+// Destination of a streaming add: extents while they fit, then block pointers,
+// or compressed chunks whose table blocks go through the block-pointer map
+typedef struct {
+    Inode *inode;
+    int use_extents;
+    BlockMap map;
+    size_t written;
+    uint32_t next_block;                  // File blocks covered so far, holes included
+    uint32_t holes;                       // All-zero blocks left out as holes
+    uint32_t shared;                      // Blocks deduplicated against existing ones
+    uint8_t *packed;                      // Compression output, NULL unless compressing
+    CompressedChunk table[CHUNKS_PER_TABLE]; // Chunk table block being filled
+    uint32_t chunks;                      // Chunks stored so far
+    uint64_t stored_blocks;               // Blocks used by the stored chunks
+} FileWriter;
+
+// What a streaming add saved, for the final report
+typedef struct {
+    uint32_t holes;                       // All-zero blocks left out as holes
+    uint32_t shared;                      // Blocks deduplicated against existing ones
+    uint64_t stored_blocks;               // Blocks holding compressed chunks
+} WriteStats;
 
 /**
- * Find a free inode by scanning all inode segments.
+ * Print the add progress whenever the percentage (or, for input of unknown
+ * length, the megabyte count) changes.
  */
-int find_free_inode() {
-    Inode inode;
-    for (int s = 0; s < num_inode_segments; ++s) {
-        for (int i = 0; i < INODES_PER_SEGMENT; ++i) {
-            fseek(inode_segments[s], i * sizeof(Inode), SEEK_SET);
-            fread(&inode, sizeof(Inode), 1, inode_segments[s]);
-            if (inode.type == 0) {
-                return (s * INODES_PER_SEGMENT) + i;
-            }
+static void report_progress(size_t written, size_t total_size, int *last_percent) {
+    if (total_size == 0) {
+        int mb = (int)(written >> 20);
+        if (mb != *last_percent) {
+            fprintf(stderr, "\r[add] Written: %d MB", mb);
+            *last_percent = mb;
         }
+        return;
     }
 
-    create_new_inode_segment();
-    fseek(inode_segments[num_inode_segments - 1], 0, SEEK_SET);
-    memset(&inode, 0, sizeof(Inode));
-    fwrite(&inode, sizeof(Inode), 1, inode_segments[num_inode_segments - 1]);
-    fflush(inode_segments[num_inode_segments - 1]);
-    return ((num_inode_segments - 1) * INODES_PER_SEGMENT);
-}
-
-/**
- * Find a free data block by scanning all data segments or creating a new one.
- */
-int find_free_block() {
-    char buffer[BLOCK_SIZE];
-    for (int s = 0; s < num_data_segments; ++s) {
-        for (int b = 1; b < BLOCKS_PER_SEGMENT; ++b) {
-            int used = 0;
-
-            for (int i = 0; i < num_inode_segments && !used; ++i) {
-                for (int j = 0; j < INODES_PER_SEGMENT; ++j) {
-                    Inode inode;
-                    fseek(inode_segments[i], j * sizeof(Inode), SEEK_SET);
-                    fread(&inode, sizeof(Inode), 1, inode_segments[i]);
-                    for (int k = 0; k < DIRECT_BLOCKS; ++k) {
-                        int block_num = inode.direct[k];
-                        int seg_idx, blk_idx;
-                        get_segment_and_block_offset(block_num, &seg_idx, &blk_idx);
-                        if (seg_idx == s && blk_idx == b) {
-                            used = 1;
-                            break;
-                        }
-                    }
-                    if (used) break;
-                }
-            }
+    int percent = (int)((written * 100) / total_size);
+    if (percent != *last_percent) {
+        fprintf(stderr, "\r[add] Progress: %3d%%", percent);
+        *last_percent = percent;
+    }
+}
 
-            if (used) continue;
+/**
+ * Return 1 if a block holds only zeros. The block is OR-ed together a vector
+ * at a time (AVX2 when the CPU has it), stopping at the first non-zero stride,
+ * so data blocks are usually rejected after their first 256 bytes.
+ */
+ZERO_SCAN_CLONES
+static int block_is_zero(const void *block) {
+    const uint8_t *p = block;
+    for (size_t off = 0; off < BLOCK_SIZE; off += ZERO_SCAN_STRIDE) {
+        ZeroScanLanes acc = {0};
+        for (size_t i = 0; i < ZERO_SCAN_STRIDE; i += sizeof(ZeroScanLanes)) {
+            ZeroScanLanes v;
+            memcpy(&v, p + off + i, sizeof(v));
+            acc |= v;
+        }
+        if (acc[0] | acc[1] | acc[2] | acc[3]) return 0;
+    }
+    return 1;
+}
+
+// A pointer block that maps only holes is not written: its own pointer stays 0
+
+static void flush_single(BlockMap *map) {
+    if (!map->inode->indirect_single && block_is_zero(map->single)) return;
+    if (!map->inode->indirect_single) map->inode->indirect_single = find_free_block();
+    write_block(map->inode->indirect_single, map->single);
+}
 
-            fseek(data_segments[s], b * BLOCK_SIZE, SEEK_SET);
-            fread(buffer, BLOCK_SIZE, 1, data_segments[s]);
-            int all_zero = 1;
-            for (size_t j = 0; j < BLOCK_SIZE; ++j) {
-                if (buffer[j] != 0) {
-                    all_zero = 0;
-                    break;
-                }
+/**
+ * Write the leaf being filled to the block in `*slot` (allocated on first use).
+ */
+static void flush_leaf(BlockMap *map, uint32_t *slot) {
+    if (!*slot && block_is_zero(map->leaf)) return;
+    if (!*slot) *slot = find_free_block();
+    write_block(*slot, map->leaf);
+    memset(map->leaf, 0, sizeof(map->leaf));
+}
+
+static void flush_mid(BlockMap *map, uint32_t index) {
+    if (!map->triple[index] && block_is_zero(map->mid)) return;
+    if (!map->triple[index]) map->triple[index] = find_free_block();
+    write_block(map->triple[index], map->mid);
+    memset(map->mid, 0, sizeof(map->mid));
+}
+
+/**
+ * Append one data block to the block-pointer map. Returns -1 if the file
+ * outgrows triple indirect blocks.
+ */
+static int map_append(BlockMap *map, uint32_t block) {
+    const uint32_t per = PTRS_PER_BLOCK;
+    uint32_t n = map->blocks;
+    if (n >= MAX_FILE_BLOCKS) {
+        fprintf(stderr, "\n[add-error] File too large: triple indirect blocks are full\n");
+        return -1;
+    }
+
+    if (n < DIRECT_BLOCKS) {
+        map->inode->direct[n] = block;
+    } else if (n < DIRECT_BLOCKS + per) {
+        map->single[n - DIRECT_BLOCKS] = block;
+        if (n - DIRECT_BLOCKS == per - 1) flush_single(map);
+    } else if (n < DIRECT_BLOCKS + per + per * per) {
+        uint32_t k = n - DIRECT_BLOCKS - per;
+        map->leaf[k % per] = block;
+        if (k % per == per - 1) flush_leaf(map, &map->top[k / per]);
+    } else {
+        uint32_t k = n - DIRECT_BLOCKS - per - per * per;
+        map->leaf[k % per] = block;
+        if (k % per == per - 1) {
+            flush_leaf(map, &map->mid[(k / per) % per]);
+            if ((k / per) % per == per - 1) flush_mid(map, k / (per * per));
+        }
+    }
+    map->blocks++;
+    return 0;
+}
+
+/**
+ * Write out the partially filled pointer blocks and the double and triple
+ * indirect top levels.
+ */
+static void map_finish(BlockMap *map) {
+    const uint32_t per = PTRS_PER_BLOCK;
+    uint32_t n = map->blocks;
+    if (n > DIRECT_BLOCKS && n < DIRECT_BLOCKS + per) flush_single(map);
+    if (n > DIRECT_BLOCKS + per) {
+        uint32_t k = n - DIRECT_BLOCKS - per;
+        if (k < per * per && k % per != 0) flush_leaf(map, &map->top[k / per]);
+        if (!map->inode->indirect_double && !block_is_zero(map->top)) map->inode->indirect_double = find_free_block();
+        if (map->inode->indirect_double) write_block(map->inode->indirect_double, map->top);
+    }
+    if (n > DIRECT_BLOCKS + per + per * per) {
+        uint32_t k = n - DIRECT_BLOCKS - per - per * per;
+        if (k % per != 0) flush_leaf(map, &map->mid[(k / per) % per]);
+        if (k % (per * per) != 0) flush_mid(map, k / (per * per));
+        if (!map->inode->large.indirect_triple && !block_is_zero(map->triple)) {
+            map->inode->large.indirect_triple = find_free_block();
+        }
+        if (map->inode->large.indirect_triple) write_block(map->inode->large.indirect_triple, map->triple);
+    }
+}
+
+/**
+ * Switch a file from extents to block pointers, mapping the blocks already
+ * written and the holes between them.
+ */
+static int convert_to_block_map(FileWriter *w) {
+    Extent saved[MAX_INLINE_EXTENTS];
+    int count = w->inode->extent_count;
+    memcpy(saved, w->inode->extents, count * sizeof(Extent));
+
+    fprintf(stderr, "\n[add] File needs more than %d extents, using block pointers\n", inode_extent_capacity());
+    memset(w->inode->extents, 0, sizeof(w->inode->extents));
+    w->inode->extent_count = 0;
+    w->inode->flags &= ~INODE_EXTENTS;
+    w->use_extents = 0;
+
+    for (int e = 0; e < count; ++e) {
+        while (w->map.blocks < saved[e].logical) {
+            if (map_append(&w->map, 0) < 0) return -1;
+        }
+        for (uint32_t b = 0; b < saved[e].length; ++b) {
+            if (map_append(&w->map, saved[e].start + b) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Record a run of newly written blocks at file block `next_block` in the
+ * file's mapping, extending the last extent when the run continues it on disk
+ * and in the file. Holes skipped before the run become 0 pointers.
+ */
+static int writer_add_run(FileWriter *w, uint32_t start, uint32_t count) {
+    Inode *inode = w->inode;
+    if (w->use_extents) {
+        if (inode->extent_count > 0) {
+            Extent *last = &inode->extents[inode->extent_count - 1];
+            if (start == last->start + last->length && start / BLOCKS_PER_SEGMENT == last->start / BLOCKS_PER_SEGMENT &&
+                last->logical + last->length == w->next_block) {
+                last->length += count;
+                w->next_block += count;
+                return 0;
             }
+        }
+        if (inode->extent_count < inode_extent_capacity()) {
+            Extent *e = &inode->extents[inode->extent_count++];
+            e->logical = w->next_block;
+            e->start = start;
+            e->length = count;
+            w->next_block += count;
+            return 0;
+        }
+        if (convert_to_block_map(w) < 0) return -1;
+    }
+
+    while (w->map.blocks < w->next_block) {
+        if (map_append(&w->map, 0) < 0) return -1;
+    }
+    for (uint32_t b = 0; b < count; ++b) {
+        if (map_append(&w->map, start + b) < 0) return -1;
+    }
+    w->next_block += count;
+    return 0;
+}
 
-            if (all_zero) return s * BLOCKS_PER_SEGMENT + b;
+/**
+ * Write `count` whole blocks into freshly allocated block runs. With
+ * fingerprints in `fps`, the new blocks are added to the dedup index.
+ */
+static int write_new_blocks(FileWriter *w, const uint8_t *data, uint32_t count, const uint64_t *fps) {
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t got;
+        uint32_t start = alloc_block_run(count - done, &got);
+        write_block_run(start, got, data + (size_t)done * BLOCK_SIZE);
+        if (writer_add_run(w, start, got) < 0) {
+            for (uint32_t b = 0; b < got; ++b) mark_block_free(start + b);
+            return -1;
         }
+        for (uint32_t b = 0; fps && b < got; ++b) dedup_insert(fps[done + b], start + b);
+        done += got;
     }
+    return 0;
+}
 
-    create_new_data_segment();
-    return (num_data_segments - 1) * BLOCKS_PER_SEGMENT + 1;
+/**
+ * Write `count` whole blocks, mapping each block that matches an indexed one
+ * to the existing copy. Unmatched blocks are collected into runs and written
+ * together; a run is written early when a later block of the chunk repeats
+ * one of its blocks, so the repeat can share it.
+ */
+static int write_dedup_blocks(FileWriter *w, const uint8_t *data, uint32_t count) {
+    uint64_t fps[ADD_CHUNK_SIZE / BLOCK_SIZE];
+    uint32_t pending = 0;   // First block of the unmatched run not written yet
+    for (uint32_t b = 0; b < count; ++b) {
+        const uint8_t *block = data + (size_t)b * BLOCK_SIZE;
+        fps[b] = block_fingerprint(block);
+        uint32_t shared = dedup_share(fps[b], block);
+        if (!shared) {
+            int repeat = 0;
+            for (uint32_t p = pending; p < b && !repeat; ++p) repeat = fps[p] == fps[b];
+            if (!repeat) continue;
+            if (write_new_blocks(w, data + (size_t)pending * BLOCK_SIZE, b - pending, fps + pending) < 0) return -1;
+            pending = b;
+            shared = dedup_share(fps[b], block);
+            if (!shared) continue;   // Same fingerprint, different contents
+        }
+
+        if (write_new_blocks(w, data + (size_t)pending * BLOCK_SIZE, b - pending, fps + pending) < 0 ||
+            writer_add_run(w, shared, 1) < 0) {
+            dedup_release(shared);   // Another file still owns it
+            return -1;
+        }
+        pending = b + 1;
+        w->shared++;
+    }
+    return write_new_blocks(w, data + (size_t)pending * BLOCK_SIZE, count - pending, fps + pending);
 }
 
 /**
- * Add a host file to ExFS2 under the provided exfs_path.
+ * Write `count` whole blocks, leaving all-zero blocks out as holes. The data
+ * blocks between them are deduplicated with EXFS2_DEDUP or written as new runs.
  */
-void run_add(const char *exfs_path, const char *host_path) {
-    fprintf(stderr, "[add] Adding '%s' into '%s'\n", host_path, exfs_path);
+static int write_sparse_blocks(FileWriter *w, const uint8_t *data, uint32_t count) {
+    uint32_t pending = 0;   // First block of the data run not written yet
+    for (uint32_t b = 0; b <= count; ++b) {
+        if (b < count && !block_is_zero(data + (size_t)b * BLOCK_SIZE)) continue;
+        if (b > pending) {
+            const uint8_t *run = data + (size_t)pending * BLOCK_SIZE;
+            int status = dedup_enabled() ? write_dedup_blocks(w, run, b - pending)
+                                         : write_new_blocks(w, run, b - pending, NULL);
+            if (status < 0) return -1;
+        }
+        if (b < count) {
+            w->next_block++;
+            w->holes++;
+        }
+        pending = b + 1;
+    }
+    return 0;
+}
+
+/**
+ * Write the chunk table block being filled and map it like a data block.
+ * If it cannot be mapped, the table block and the chunk runs it lists are
+ * freed here: releasing the file only finds chunks through mapped tables.
+ */
+static int flush_chunk_table(FileWriter *w) {
+    uint32_t block = find_free_block();
+    write_block(block, w->table);
+    int status = map_append(&w->map, block);
+    if (status < 0) {
+        uint32_t entries = w->chunks % CHUNKS_PER_TABLE ? w->chunks % CHUNKS_PER_TABLE : CHUNKS_PER_TABLE;
+        for (uint32_t i = 0; i < entries; ++i) {
+            const CompressedChunk *chunk = &w->table[i];
+            for (uint32_t b = 0; b < chunk_blocks(chunk); ++b) mark_block_free(chunk->start + b);
+        }
+        mark_block_free(block);
+    }
+    memset(w->table, 0, sizeof(w->table));
+    return status;
+}
+
+/**
+ * Store `len` bytes as compressed chunks. A chunk is kept compressed only if
+ * that saves at least one block; each stored chunk is one contiguous run.
+ * `data` must be zero-padded to a whole block.
+ */
+static int write_compressed_chunks(FileWriter *w, const uint8_t *data, size_t len) {
+    for (size_t off = 0; off < len; off += COMPRESS_CHUNK_SIZE) {
+        uint32_t chunk_len = len - off < COMPRESS_CHUNK_SIZE ? (uint32_t)(len - off) : COMPRESS_CHUNK_SIZE;
+        uint32_t raw_blocks = (chunk_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t packed = lz_compress(data + off, chunk_len, w->packed, (size_t)(raw_blocks - 1) * BLOCK_SIZE);
+
+        CompressedChunk *chunk = &w->table[w->chunks % CHUNKS_PER_TABLE];
+        chunk->stored = packed ? (uint32_t)packed : chunk_len | CHUNK_RAW;
+        uint32_t blocks = chunk_blocks(chunk);
+        if (packed) memset(w->packed + packed, 0, (size_t)blocks * BLOCK_SIZE - packed);
+
+        chunk->start = alloc_block_run_exact(blocks);
+        write_block_run(chunk->start, blocks, packed ? w->packed : data + off);
+        w->stored_blocks += blocks;
+        if (++w->chunks % CHUNKS_PER_TABLE == 0 && flush_chunk_table(w) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write one input chunk: compressed with EXFS2_COMPRESS, else with all-zero
+ * blocks as holes and the rest deduplicated with EXFS2_DEDUP. `data` must
+ * have room to be zero-padded to a whole block.
+ */
+static int writer_write(FileWriter *w, uint8_t *data, size_t len) {
+    uint32_t blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset(data + len, 0, (size_t)blocks * BLOCK_SIZE - len);
+
+    int status = w->packed ? write_compressed_chunks(w, data, len) : write_sparse_blocks(w, data, blocks);
+    if (status < 0) return -1;
+    w->written += len;
+    return 0;
+}
+
+/**
+ * Stream the host input into `new_file`: input that ends within the inline
+ * capacity is stored in the inode, anything longer goes to contiguous extents
+ * and falls back to block pointers when the extents do not fit the inode.
+ * All-zero blocks are not stored: they are holes in the mapping.
+ * With EXFS2_COMPRESS it is stored as compressed chunks instead.
+ * `total_size` is only used for progress (0 if unknown). Dedup and
+ * compression savings go to `stats`. Returns 0 on success; on failure
+ * (including a read error on the input) every block written so far is released.
+ */
+static int write_stream(FILE *src, size_t total_size, Inode *new_file, WriteStats *stats) {
+    InputStream *in = input_open(src, ADD_CHUNK_SIZE);
+    if (!in) {
+        fprintf(stderr, "[add] Out of memory allocating input buffers\n");
+        return -1;
+    }
+
+    FileWriter w;
+    memset(&w, 0, sizeof(w));
+    w.inode = new_file;
+    w.map.inode = new_file;
+    w.use_extents = 1;
+
+    int status = 0;
+    int last_percent = -1;
+    uint8_t *data;
+    size_t len = input_next(in, &data);
+
+    if (len < ADD_CHUNK_SIZE && len <= inode_inline_capacity()) {
+        // --- Whole input fits in the inode ---
+        memcpy(new_file->inline_data, data, len);
+        new_file->flags |= INODE_INLINE;
+        w.written = len;
+    } else {
+        if (compress_enabled() && (w.packed = malloc(COMPRESS_CHUNK_SIZE)) != NULL) {
+            new_file->flags |= INODE_COMPRESSED;
+            w.use_extents = 0;
+        } else {
+            new_file->flags |= INODE_EXTENTS;
+        }
+        while (len > 0) {
+            if (writer_write(&w, data, len) < 0) {
+                status = -1;
+                break;
+            }
+            report_progress(w.written, total_size, &last_percent);
+            len = input_next(in, &data);   // Reader already filled the other buffer meanwhile
+        }
+        if (status == 0 && w.packed && w.chunks % CHUNKS_PER_TABLE != 0) status = flush_chunk_table(&w);
+        if (!w.use_extents) map_finish(&w.map);
+    }
+    if (status == 0 && input_failed(in)) {
+        fprintf(stderr, "[add] Input ended on a read error after %llu bytes, nothing added\n", (unsigned long long)w.written);
+        status = -1;
+    }
+    input_close(in);
+    free(w.packed);
 
+    set_inode_file_size(new_file, w.written);
+    stats->holes = w.holes;
+    stats->shared = w.shared;
+    stats->stored_blocks = w.stored_blocks;
+    if (status < 0) release_file_blocks(new_file);
+    return status;
+}
+
+/**
+ * Add the contents of an open stream to ExFS2 under `exfs_path`. Regular
+ * files report a percentage; pipes and sockets report bytes written.
+ * Returns 0 on success, -1 on failure.
+ */
+static int add_stream(const char *exfs_path, FILE *src) {
     const char *filename = strrchr(exfs_path, '/');
     if (!filename || strlen(filename + 1) == 0) {
         fprintf(stderr, "[add] Invalid path: missing filename\n");
-        return;
+        return -1;
     }
     filename++;
 
     int parent_inode = find_or_create_path(exfs_path);
     if (parent_inode < 0) {
         fprintf(stderr, "[add] Failed to resolve parent path\n");
-        return;
+        return -1;
     }
 
-    FILE *src = fopen(host_path, "rb");
-    if (!src) {
-        perror("[add] Failed to open host file");
-        return;
+    if (dir_lookup(parent_inode, filename) >= 0) {
+        fprintf(stderr, "[add] '%s' already exists\n", exfs_path);
+        return -1;
     }
 
-    fseek(src, 0, SEEK_END);
-    size_t total_size = ftell(src);
-    rewind(src);
+    struct stat st;
+    size_t total_size = (fstat(fileno(src), &st) == 0 && S_ISREG(st.st_mode)) ? (size_t)st.st_size : 0;
 
     Inode new_file = {0};
     new_file.type = TYPE_FILE;
 
-    size_t written = 0, bytes_read;
-    uint32_t total_blocks = 0;
-    int last_percent = -1;
-    char buffer[BLOCK_SIZE];
-
-    // Allocate indirect block buffers
-    uint32_t *indirect_single = calloc(PTRS_PER_BLOCK, sizeof(uint32_t));
-    uint32_t *indirect_double = calloc(PTRS_PER_BLOCK, sizeof(uint32_t));
-    uint32_t **double_level = calloc(PTRS_PER_BLOCK, sizeof(uint32_t *));
-
-    for (int i = 0; i < PTRS_PER_BLOCK; i++) {
-        double_level[i] = calloc(PTRS_PER_BLOCK, sizeof(uint32_t));
-    }
-
-    // --- File block writing loop ---
-    while ((bytes_read = fread(buffer, 1, BLOCK_SIZE, src)) > 0) {
-        int block = find_free_block();
-        int seg, blk;
-        get_segment_and_block_offset(block, &seg, &blk);
-        fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-        fwrite(buffer, bytes_read, 1, data_segments[seg]);
-        fflush(data_segments[seg]);
-        new_file.size += bytes_read;
-
-        if (total_blocks < DIRECT_BLOCKS) {
-            new_file.direct[total_blocks] = block;
-        } else if (total_blocks < DIRECT_BLOCKS + PTRS_PER_BLOCK) {
-            indirect_single[total_blocks - DIRECT_BLOCKS] = block;
-        } else if (total_blocks < DIRECT_BLOCKS + PTRS_PER_BLOCK * (1 + PTRS_PER_BLOCK)) {
-            int i = (total_blocks - DIRECT_BLOCKS - PTRS_PER_BLOCK) / PTRS_PER_BLOCK;
-            int j = (total_blocks - DIRECT_BLOCKS - PTRS_PER_BLOCK) % PTRS_PER_BLOCK;
-            indirect_double[i] = indirect_double[i] ? indirect_double[i] : find_free_block();
-            double_level[i][j] = block;
-        } else {
-            fprintf(stderr, "[add-error] File too large: triple indirect blocks are not supported\n");
-            fclose(src);
-            return;
-        }
-
-        written += bytes_read;
-        total_blocks++;
-        int percent = (int)((written * 100) / total_size);
-        if (percent != last_percent) {
-            fprintf(stderr, "\r[add] Progress: %3d%%", percent);
-            last_percent = percent;
-        }
-    }
+    WriteStats stats = {0};
+    if (write_stream(src, total_size, &new_file, &stats) < 0) return -1;
     fprintf(stderr, "\r[add] Progress: 100%%\n");
-    fclose(src);
-
-    // --- Write single indirect ---
-    if (total_blocks > DIRECT_BLOCKS) {
-        new_file.indirect_single = find_free_block();
-        int seg, blk;
-        get_segment_and_block_offset(new_file.indirect_single, &seg, &blk);
-        fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-        fwrite(indirect_single, sizeof(uint32_t), PTRS_PER_BLOCK, data_segments[seg]);
-        fflush(data_segments[seg]);
-    }
 
-    // --- Write double indirect ---
-    if (total_blocks > DIRECT_BLOCKS + PTRS_PER_BLOCK) {
-        new_file.indirect_double = find_free_block();
-        int seg, blk;
-        get_segment_and_block_offset(new_file.indirect_double, &seg, &blk);
-        uint32_t double_ptrs[PTRS_PER_BLOCK] = {0};
-
-        for (int i = 0; i < PTRS_PER_BLOCK && indirect_double[i]; i++) {
-            double_ptrs[i] = indirect_double[i];
-            int seg2, blk2;
-            get_segment_and_block_offset(double_ptrs[i], &seg2, &blk2);
-            fseek(data_segments[seg2], blk2 * BLOCK_SIZE, SEEK_SET);
-            fwrite(double_level[i], sizeof(uint32_t), PTRS_PER_BLOCK, data_segments[seg2]);
-        }
+    // --- Write inode ---
+    int inode_num = find_free_inode();
+    write_inode(inode_num, &new_file);
 
-        fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-        fwrite(double_ptrs, sizeof(uint32_t), PTRS_PER_BLOCK, data_segments[seg]);
+    // --- Add directory entry (on failure, give back the inode and every block written) ---
+    if (dir_insert(parent_inode, filename, inode_num) != 0) {
+        fprintf(stderr, "[add] Failed to link '%s' into its directory\n", filename);
+        release_file_blocks(&new_file);
+        clear_inode(inode_num);
+        mark_inode_free(inode_num);
+        return -1;
     }
 
-    // --- Write inode ---
-    int inode_num = find_free_inode();
-    int seg, off;
-    get_segment_and_inode_offset(inode_num, &seg, &off);
-    fseek(inode_segments[seg], off * sizeof(Inode), SEEK_SET);
-    fwrite(&new_file, sizeof(Inode), 1, inode_segments[seg]);
-    fflush(inode_segments[seg]);
+    fprintf(stderr, "[add] File '%s' added successfully. size=%llu bytes\n", filename,
+            (unsigned long long)inode_file_size(&new_file));
+    uint64_t size = inode_file_size(&new_file), raw_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (new_file.flags & INODE_COMPRESSED) {
+        fprintf(stderr, "[add] Compressed into %llu blocks (%llu%% of %llu)\n", (unsigned long long)stats.stored_blocks,
+                (unsigned long long)(100 * stats.stored_blocks / raw_blocks), (unsigned long long)raw_blocks);
+    } else if (dedup_enabled()) {
+        fprintf(stderr, "[add] %u blocks deduplicated\n", stats.shared);
+    }
+    if (stats.holes > 0) fprintf(stderr, "[add] %u all-zero blocks stored as holes\n", stats.holes);
+    return 0;
+}
 
-    // --- Add directory entry ---
-    update_directory_entry(parent_inode, inode_num, filename);
+/**
+ * Add a stream as one journal transaction. Returns 0 on success, -1 on failure.
+ */
+int run_add_stream(const char *exfs_path, FILE *src) {
+    journal_begin();
+    int status = add_stream(exfs_path, src);
+    journal_commit();
+    return status;
+}
 
-    fprintf(stderr, "[add] File '%s' added successfully. size=%u bytes\n", filename, new_file.size);
+/**
+ * Add a host file to ExFS2 under the provided exfs_path. A host path of "-"
+ * reads from stdin; pipes and other non-seekable inputs are streamed.
+ * Returns 0 on success, -1 on failure.
+ */
+int run_add(const char *exfs_path, const char *host_path) {
+    fprintf(stderr, "[add] Adding '%s' into '%s'\n", host_path, exfs_path);
 
-    // --- Cleanup ---
-    free(indirect_single);
-    free(indirect_double);
-    for (int i = 0; i < PTRS_PER_BLOCK; i++) {
-        free(double_level[i]);
+    int from_stdin = strcmp(host_path, "-") == 0;
+    FILE *src = from_stdin ? stdin : fopen(host_path, "rb");
+    if (!src) {
+        perror("[add] Failed to open host file");
+        return -1;
     }
-    free(double_level);
+
+    int status = run_add_stream(exfs_path, src);
+    if (!from_stdin) fclose(src);
+    return status;
 }
@@ -0,0 +1,542 @@
+// alloc.c
+// Persistent free-block and free-inode bitmaps and their allocators
+
+#include "exfs2.h"
+
+#define BLOCK_BITMAP_FILE "block_bitmap.seg"
+#define INODE_BITMAP_FILE "inode_bitmap.seg"
+#define BLOCK_BITMAP_MAGIC 0x45584242          // "EXBB"
+#define INODE_BITMAP_MAGIC 0x45584249          // "EXBI"
+#define BLOCK_WORDS_PER_SEGMENT (BLOCKS_PER_SEGMENT / 64)
+#define NO_FREE_BIT UINT32_MAX
+
+// On-disk header stored in front of the bitmap words
+typedef struct {
+    uint32_t magic;        // BLOCK_BITMAP_MAGIC or INODE_BITMAP_MAGIC
+    uint32_t value;        // Next-fit cursor (blocks) or number of inode segments (inodes)
+} BitmapHeader;
+
+// Block bitmap, grown (doubling) as data segments are added
+static uint64_t *block_bitmap;          // 1 bit per global block, set = in use
+static int data_segments_tracked = 0;   // Segments the bitmap has room for
+static uint32_t block_cursor = 1;
+static int block_bitmap_dirty = 0;
+
+// Blocks freed by transactions whose records may not be on disk yet. They are
+// not handed out again until those records are durable: after a crash the
+// journal would otherwise replay a removed file over its blocks' new owner.
+static uint64_t *block_held;            // 1 bit per global block, set = freed but held
+static uint32_t held_count = 0;
+static uint64_t held_seq = 0;           // Newest transaction that freed a held block
+
+// Inode bitmap, sized to the existing inode segments (inodes per segment depends on inode size)
+static uint64_t *inode_bitmap;          // 1 bit per global inode, set = in use
+static uint16_t *inode_free_count;      // Free inodes per inode segment
+static int inode_segments_tracked = 0;
+static int inode_bitmap_dirty = 0;
+
+#define INODE_WORDS_PER_SEGMENT (inodes_per_segment / 64)
+
+/**
+ * Grow the in-memory inode bitmap to cover `segments` inode segments.
+ * New segments start out completely free.
+ */
+static void track_inode_segments(int segments) {
+    if (segments <= inode_segments_tracked) return;
+
+    inode_bitmap = realloc(inode_bitmap, (size_t)segments * INODE_WORDS_PER_SEGMENT * sizeof(uint64_t));
+    inode_free_count = realloc(inode_free_count, (size_t)segments * sizeof(uint16_t));
+    if (!inode_bitmap || !inode_free_count) {
+        fprintf(stderr, "[alloc] Out of memory for inode bitmap\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int s = inode_segments_tracked; s < segments; ++s) {
+        memset(inode_bitmap + (size_t)s * INODE_WORDS_PER_SEGMENT, 0, INODE_WORDS_PER_SEGMENT * sizeof(uint64_t));
+        inode_free_count[s] = inodes_per_segment;
+    }
+    inode_segments_tracked = segments;
+}
+
+/**
+ * Grow the in-memory block bitmap to cover at least `segments` data segments.
+ * New segments start out completely free.
+ */
+static void track_data_segments(int segments) {
+    if (segments <= data_segments_tracked) return;
+
+    int capacity = data_segments_tracked ? data_segments_tracked : 64;
+    while (capacity < segments) capacity *= 2;
+    block_bitmap = realloc(block_bitmap, (size_t)capacity * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t));
+    block_held = realloc(block_held, (size_t)capacity * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t));
+    if (!block_bitmap || !block_held) {
+        fprintf(stderr, "[alloc] Out of memory for block bitmap\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(block_bitmap + (size_t)data_segments_tracked * BLOCK_WORDS_PER_SEGMENT, 0,
+           (size_t)(capacity - data_segments_tracked) * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t));
+    memset(block_held + (size_t)data_segments_tracked * BLOCK_WORDS_PER_SEGMENT, 0,
+           (size_t)(capacity - data_segments_tracked) * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t));
+    data_segments_tracked = capacity;
+}
+
+/**
+ * Check that a block lies in an existing data segment, growing the bitmap
+ * for segments added since it was last sized.
+ */
+static int block_tracked(uint32_t block_num) {
+    uint32_t seg = block_num / BLOCKS_PER_SEGMENT;
+    if (seg >= (uint32_t)num_data_segments) return 0;
+    track_data_segments(num_data_segments);
+    return 1;
+}
+
+/**
+ * Find the first bit in [start, end) that is clear in both `bitmap` and
+ * `held`, scanning 64 entries per step.
+ */
+static uint32_t find_clear_bit(const uint64_t *bitmap, const uint64_t *held, uint32_t start, uint32_t end) {
+    uint32_t bit = start;
+    while (bit < end) {
+        uint64_t free_bits = ~(bitmap[bit / 64] | held[bit / 64]) & (~0ULL << (bit % 64));
+        if (free_bits) {
+            uint32_t found = (bit & ~63u) + __builtin_ctzll(free_bits);
+            return found < end ? found : NO_FREE_BIT;
+        }
+        bit = (bit & ~63u) + 64;
+    }
+    return NO_FREE_BIT;
+}
+
+/**
+ * Find the first bit in [start, end) that is set in `bitmap` or `held`, or
+ * `end` if there is none.
+ */
+static uint32_t find_set_bit(const uint64_t *bitmap, const uint64_t *held, uint32_t start, uint32_t end) {
+    uint32_t bit = start;
+    while (bit < end) {
+        uint64_t used_bits = (bitmap[bit / 64] | held[bit / 64]) & (~0ULL << (bit % 64));
+        if (used_bits) {
+            uint32_t found = (bit & ~63u) + __builtin_ctzll(used_bits);
+            return found < end ? found : end;
+        }
+        bit = (bit & ~63u) + 64;
+    }
+    return end;
+}
+
+/**
+ * Read a bitmap file into memory. `extra` (if any) is stored after the words
+ * and the header value is returned in `value`.
+ * Returns 1 on success, 0 if the file is missing or not a valid bitmap.
+ */
+static int load_bitmap_file(const char *filename, uint32_t magic, void *words, size_t words_size,
+                            void *extra, size_t extra_size, uint32_t *value) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return 0;
+
+    BitmapHeader header = {0};
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == magic &&
+             fread(words, words_size, 1, fp) == 1 &&
+             (extra_size == 0 || fread(extra, extra_size, 1, fp) == 1);
+    fclose(fp);
+
+    if (ok) *value = header.value;
+    return ok;
+}
+
+/**
+ * Write a bitmap file, replacing any previous contents.
+ */
+static void save_bitmap_file(const char *filename, uint32_t magic, const void *words, size_t words_size,
+                             const void *extra, size_t extra_size, uint32_t value) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        perror("[alloc] Failed to write bitmap");
+        return;
+    }
+    BitmapHeader header = { magic, value };
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(words, words_size, 1, fp);
+    if (extra_size) fwrite(extra, extra_size, 1, fp);
+    fclose(fp);
+}
+
+/**
+ * Mark a global block number as allocated.
+ */
+void mark_block_used(uint32_t block_num) {
+    if (!block_tracked(block_num)) return;
+    block_bitmap[block_num / 64] |= (1ULL << (block_num % 64));
+    block_bitmap_dirty = 1;
+    journal_log_bitmap(1, block_num, 1);
+}
+
+/**
+ * Return a global block number to the free pool. Its contents stay on disk
+ * until the next checkpoint punches it out (reclaim.c). Inside a transaction
+ * the block is held back from the allocators until the transaction is durable.
+ * Block 0 of each segment is reserved and is never released.
+ */
+void mark_block_free(uint32_t block_num) {
+    if (!block_tracked(block_num) || block_num % BLOCKS_PER_SEGMENT == 0) return;
+    block_bitmap[block_num / 64] &= ~(1ULL << (block_num % 64));
+    block_bitmap_dirty = 1;
+    if (journal_active()) {
+        uint64_t mask = 1ULL << (block_num % 64);
+        if (!(block_held[block_num / 64] & mask)) held_count++;
+        block_held[block_num / 64] |= mask;
+        held_seq = journal_seq();
+    }
+    journal_log_bitmap(1, block_num, 0);
+    reclaim_defer(block_num);
+}
+
+/**
+ * Hand held blocks back to the allocators once the transactions that freed
+ * them are durable. With `force`, syncs the journal for them first, which
+ * only helps once the freeing transaction has committed.
+ */
+static void release_held_blocks(int force) {
+    if (held_count == 0 || !journal_durable(held_seq, force)) return;
+    memset(block_held, 0, (size_t)data_segments_tracked * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t));
+    held_count = 0;
+}
+
+/**
+ * Return 1 if a global block number is allocated.
+ */
+int block_is_used(uint32_t block_num) {
+    if (!block_tracked(block_num)) return 0;
+    return (block_bitmap[block_num / 64] >> (block_num % 64)) & 1;
+}
+
+/**
+ * Mark a global inode number as allocated.
+ */
+void mark_inode_used(uint32_t inode_num) {
+    track_inode_segments(num_inode_segments);   // Journal replay can add segments
+    if (inode_num >= (uint32_t)inode_segments_tracked * inodes_per_segment) return;
+    uint64_t mask = 1ULL << (inode_num % 64);
+    if (inode_bitmap[inode_num / 64] & mask) return;
+    inode_bitmap[inode_num / 64] |= mask;
+    inode_free_count[inode_num / inodes_per_segment]--;
+    inode_bitmap_dirty = 1;
+    journal_log_bitmap(0, inode_num, 1);
+}
+
+/**
+ * Return a global inode number to the free pool. The root inode is never released.
+ */
+void mark_inode_free(uint32_t inode_num) {
+    track_inode_segments(num_inode_segments);
+    if (inode_num == 0 || inode_num >= (uint32_t)inode_segments_tracked * inodes_per_segment) return;
+    uint64_t mask = 1ULL << (inode_num % 64);
+    if (!(inode_bitmap[inode_num / 64] & mask)) return;
+    inode_bitmap[inode_num / 64] &= ~mask;
+    inode_free_count[inode_num / inodes_per_segment]++;
+    inode_bitmap_dirty = 1;
+    journal_log_bitmap(0, inode_num, 0);
+}
+
+/**
+ * Mark every block referenced by an indirect pointer block (and the block itself).
+ */
+static void mark_indirect_used(uint32_t block_num, int levels) {
+    if (block_num == 0) return;
+    mark_block_used(block_num);
+
+    uint32_t ptrs[PTRS_PER_BLOCK] = {0};
+    extract_block_list(block_num, ptrs, PTRS_PER_BLOCK);
+    for (size_t i = 0; i < PTRS_PER_BLOCK; ++i) {
+        if (ptrs[i] == 0) continue;   // Hole
+        if (levels > 1) mark_indirect_used(ptrs[i], levels - 1);
+        else mark_block_used(ptrs[i]);
+    }
+}
+
+static int mark_chunk_used(const CompressedChunk *chunk, void *ctx) {
+    (void)ctx;
+    for (uint32_t b = 0; b < chunk_blocks(chunk); ++b) mark_block_used(chunk->start + b);
+    return 0;
+}
+
+/**
+ * Rebuild the bitmaps that are missing from the inode table. Used for images
+ * created before the bitmaps existed; walks direct, single, double and triple indirect
+ * pointers, extent maps, compressed chunk runs and the bucket chains of hashed directories.
+ */
+static void rebuild_bitmaps(int rebuild_blocks, int rebuild_inodes) {
+    fprintf(stderr, "[alloc] Rebuilding %s%s%s bitmap from inodes\n",
+            rebuild_blocks ? "block" : "", rebuild_blocks && rebuild_inodes ? " and " : "",
+            rebuild_inodes ? "inode" : "");
+
+    if (rebuild_inodes) {
+        memset(inode_bitmap, 0, (size_t)inode_segments_tracked * INODE_WORDS_PER_SEGMENT * sizeof(uint64_t));
+        for (int s = 0; s < inode_segments_tracked; ++s) inode_free_count[s] = inodes_per_segment;
+    }
+
+    Inode inode;
+    uint32_t total_inodes = (uint32_t)num_inode_segments * inodes_per_segment;
+    for (uint32_t n = 0; n < total_inodes; ++n) {
+        read_inode(n, &inode);
+        if (inode.type == 0) continue;
+
+        if (rebuild_inodes) mark_inode_used(n);
+        if (!rebuild_blocks) continue;
+
+        for (int k = 0; k < DIRECT_BLOCKS; ++k) {
+            if (inode.direct[k]) mark_block_used(inode.direct[k]);
+        }
+        mark_indirect_used(inode.indirect_single, 1);
+        mark_indirect_used(inode.indirect_double, 2);
+        if (inode.type == TYPE_FILE && !(inode.flags & (INODE_EXTENTS | INODE_INLINE))) {
+            mark_indirect_used(inode.large.indirect_triple, 3);
+        }
+
+        if (inode.flags & INODE_COMPRESSED) compressed_foreach(&inode, mark_chunk_used, NULL);
+
+        if (inode.type == TYPE_DIR && (inode.flags & INODE_HASHED)) {
+            dir_for_each_block(&inode, mark_block_used);
+        }
+
+        if (inode.flags & INODE_EXTENTS) {
+            for (int e = 0; e < inode.extent_count; ++e) {
+                for (uint32_t b = 0; b < inode.extents[e].length; ++b) {
+                    mark_block_used(inode.extents[e].start + b);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Load the block and inode bitmaps from disk, rebuilding any that are missing
+ * (or both, when `force_rebuild` is set after an unclean shutdown).
+ */
+void load_bitmaps(int force_rebuild) {
+    track_data_segments(num_data_segments);
+    size_t block_words_size = (size_t)num_data_segments * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t);
+    memset(block_bitmap, 0, (size_t)data_segments_tracked * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t));
+    block_cursor = 1;
+    track_inode_segments(num_inode_segments);
+
+    size_t inode_words_size = (size_t)num_inode_segments * INODE_WORDS_PER_SEGMENT * sizeof(uint64_t);
+    uint32_t inode_segments_saved = 0;
+
+    int have_blocks = !force_rebuild &&
+                      load_bitmap_file(BLOCK_BITMAP_FILE, BLOCK_BITMAP_MAGIC,
+                                       block_bitmap, block_words_size, NULL, 0, &block_cursor);
+    int have_inodes = !force_rebuild &&
+                      load_bitmap_file(INODE_BITMAP_FILE, INODE_BITMAP_MAGIC,
+                                       inode_bitmap, inode_words_size,
+                                       inode_free_count, num_inode_segments * sizeof(uint16_t),
+                                       &inode_segments_saved) &&
+                      inode_segments_saved == (uint32_t)num_inode_segments;
+    if (!have_blocks) memset(block_bitmap, 0, block_words_size);
+    if (!have_blocks || !have_inodes) rebuild_bitmaps(!have_blocks, !have_inodes);
+    block_bitmap_dirty = !have_blocks;
+    inode_bitmap_dirty = !have_inodes;
+
+    // Block 0 of every segment is reserved (segment 0 holds the root directory)
+    for (int s = 0; s < num_data_segments; ++s) {
+        mark_block_used(s * BLOCKS_PER_SEGMENT);
+    }
+    mark_inode_used(0);
+}
+
+/**
+ * Write the block and inode bitmaps back to disk if they changed.
+ */
+void sync_bitmaps() {
+    if (block_bitmap_dirty) {
+        save_bitmap_file(BLOCK_BITMAP_FILE, BLOCK_BITMAP_MAGIC,
+                         block_bitmap, (size_t)num_data_segments * BLOCK_WORDS_PER_SEGMENT * sizeof(uint64_t),
+                         NULL, 0, block_cursor);
+        block_bitmap_dirty = 0;
+    }
+    if (inode_bitmap_dirty) {
+        save_bitmap_file(INODE_BITMAP_FILE, INODE_BITMAP_MAGIC, inode_bitmap,
+                         (size_t)inode_segments_tracked * INODE_WORDS_PER_SEGMENT * sizeof(uint64_t),
+                         inode_free_count, inode_segments_tracked * sizeof(uint16_t), inode_segments_tracked);
+        inode_bitmap_dirty = 0;
+    }
+}
+
+/**
+ * Count free blocks in the existing data segments.
+ */
+uint32_t count_free_blocks() {
+    uint32_t used = 0;
+    for (uint32_t w = 0; w < (uint32_t)num_data_segments * BLOCKS_PER_SEGMENT / 64; ++w) {
+        used += __builtin_popcountll(block_bitmap[w]);
+    }
+    return num_data_segments * BLOCKS_PER_SEGMENT - used;
+}
+
+/**
+ * Count free inodes in the existing inode segments.
+ */
+uint32_t count_free_inodes() {
+    uint32_t free_inodes = 0;
+    for (int s = 0; s < num_inode_segments; ++s) free_inodes += inode_free_count[s];
+    return free_inodes;
+}
+
+/**
+ * Allocate a free data block using a next-fit scan of the bitmap,
+ * creating a new data segment when all existing ones are full.
+ */
+int find_free_block() {
+    uint32_t total = num_data_segments * BLOCKS_PER_SEGMENT;
+    if (block_cursor >= total) block_cursor = 1;
+    release_held_blocks(0);
+
+    uint32_t block = NO_FREE_BIT;
+    for (int force = 0; force < 2 && block == NO_FREE_BIT; ++force) {
+        if (force) {   // Only held blocks are free: make their transactions durable
+            if (held_count == 0) break;
+            release_held_blocks(1);
+        }
+        block = find_clear_bit(block_bitmap, block_held, block_cursor, total);
+        if (block == NO_FREE_BIT) block = find_clear_bit(block_bitmap, block_held, 1, block_cursor);
+    }
+
+    if (block == NO_FREE_BIT) {
+        create_new_data_segment();
+        mark_block_used((num_data_segments - 1) * BLOCKS_PER_SEGMENT);
+        block = (num_data_segments - 1) * BLOCKS_PER_SEGMENT + 1;
+    }
+
+    mark_block_used(block);
+    block_cursor = block + 1;
+    return block;
+}
+
+/**
+ * Allocate a free inode. Segments with no free inodes are skipped using the
+ * per-segment free counts; a new inode segment is created when all are full.
+ */
+int find_free_inode() {
+    for (int s = 0; s < num_inode_segments; ++s) {
+        if (inode_free_count[s] == 0) continue;
+
+        for (uint32_t w = 0; w < INODE_WORDS_PER_SEGMENT; ++w) {
+            uint64_t free_bits = ~inode_bitmap[s * INODE_WORDS_PER_SEGMENT + w];
+            if (free_bits) {
+                uint32_t inode_num = (s * INODE_WORDS_PER_SEGMENT + w) * 64 + __builtin_ctzll(free_bits);
+                mark_inode_used(inode_num);
+                return inode_num;
+            }
+        }
+    }
+
+    create_new_inode_segment();
+    track_inode_segments(num_inode_segments);
+    uint32_t inode_num = (num_inode_segments - 1) * inodes_per_segment;
+    mark_inode_used(inode_num);
+    return inode_num;
+}
+
+/**
+ * Allocate a run of contiguous free blocks inside a single data segment.
+ * Scans from the next-fit cursor for a run of `want` blocks (capped at one
+ * segment); if none exists the longest run found is used, and a new data
+ * segment is created only when no free block is left at all.
+ * Returns the first block of the run and stores its length in `got`.
+ */
+uint32_t alloc_block_run(uint32_t want, uint32_t *got) {
+    uint32_t goal = want < BLOCKS_PER_SEGMENT - 1 ? want : BLOCKS_PER_SEGMENT - 1;
+    uint32_t total = num_data_segments * BLOCKS_PER_SEGMENT;
+    uint32_t best_start = 0, best_len = 0;
+    if (goal == 0) goal = 1;
+    if (block_cursor >= total) block_cursor = 1;
+    release_held_blocks(0);
+
+    // Two passes: cursor -> end, then start -> cursor. If only held blocks
+    // are free, make their transactions durable and scan again.
+    for (int force = 0; force < 2 && best_len == 0; ++force) {
+        if (force) {
+            if (held_count == 0) break;
+            release_held_blocks(1);
+        }
+        for (int pass = 0; pass < 2 && best_len < goal; ++pass) {
+            uint32_t bit = pass == 0 ? block_cursor : 1;
+            uint32_t end = pass == 0 ? total : block_cursor;
+
+            while (bit < end && best_len < goal) {
+                uint32_t start = find_clear_bit(block_bitmap, block_held, bit, end);
+                if (start == NO_FREE_BIT) break;
+
+                // Runs never cross a segment boundary
+                uint32_t seg_end = (start / BLOCKS_PER_SEGMENT + 1) * BLOCKS_PER_SEGMENT;
+                uint32_t limit = seg_end < end ? seg_end : end;
+                uint32_t stop = find_set_bit(block_bitmap, block_held, start, limit);
+
+                if (stop - start > best_len) {
+                    best_start = start;
+                    best_len = stop - start;
+                }
+                bit = stop;
+            }
+        }
+    }
+
+    if (best_len == 0) {
+        create_new_data_segment();
+        mark_block_used((num_data_segments - 1) * BLOCKS_PER_SEGMENT);
+        best_start = (num_data_segments - 1) * BLOCKS_PER_SEGMENT + 1;
+        best_len = BLOCKS_PER_SEGMENT - 1;
+    }
+    if (best_len > goal) best_len = goal;
+
+    for (uint32_t b = 0; b < best_len; ++b) mark_block_used(best_start + b);
+    block_cursor = best_start + best_len;
+    *got = best_len;
+    return best_start;
+}
+
+/**
+ * Allocate exactly `count` contiguous blocks (at most one segment's worth)
+ * for a run that cannot be split, adding a data segment when no free run
+ * is long enough.
+ */
+uint32_t alloc_block_run_exact(uint32_t count) {
+    uint32_t got;
+    uint32_t start = alloc_block_run(count, &got);
+    if (got == count) return start;
+
+    for (uint32_t b = 0; b < got; ++b) mark_block_free(start + b);
+    create_new_data_segment();
+    start = (uint32_t)(num_data_segments - 1) * BLOCKS_PER_SEGMENT;
+    mark_block_used(start);
+    for (uint32_t b = 1; b <= count; ++b) mark_block_used(start + b);
+    block_cursor = start + count + 1;
+    return start + 1;
+}
+
+/**
+ * Reserve every allocatable block of one data segment for a single writer:
+ * an entirely free segment if there is one, otherwise a new segment.
+ * Returns the segment index; its blocks 1..BLOCKS_PER_SEGMENT-1 are marked used.
+ */
+int reserve_data_segment() {
+    const uint32_t words = BLOCK_WORDS_PER_SEGMENT;
+    int seg = -1;
+    release_held_blocks(0);
+    for (int s = 0; s < num_data_segments && seg < 0; ++s) {
+        const uint64_t *w = block_bitmap + (size_t)s * words, *h = block_held + (size_t)s * words;
+        int empty = ((w[0] | h[0]) & ~1ULL) == 0;   // Block 0 is always reserved
+        for (uint32_t i = 1; i < words && empty; ++i) empty = (w[i] | h[i]) == 0;
+        if (empty) seg = s;
+    }
+
+    if (seg < 0) {
+        create_new_data_segment();
+        seg = num_data_segments - 1;
+        mark_block_used((uint32_t)seg * BLOCKS_PER_SEGMENT);
+    }
+
+    for (uint32_t b = 1; b < BLOCKS_PER_SEGMENT; ++b) mark_block_used((uint32_t)seg * BLOCKS_PER_SEGMENT + b);
+    return seg;
+}
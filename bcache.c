@@ -0,0 +1,329 @@
+// bcache.c
+// Block buffer cache: all single-block data I/O goes through a fixed pool of
+// BCACHE_BLOCKS buffers with LRU eviction. Writes only dirty the buffer; dirty
+// blocks are written back in block order by bcache_flush() at the end of an
+// operation, or one at a time when evicted. Multi-block runs (extents) bypass
+// the pool but stay coherent with it. bcache_lock makes the cache safe to
+// share between server threads. Every block written to or read from a
+// segment file has its checksum recorded or verified (see checksum.c).
+
+#include "exfs2.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+#define BCACHE_BLOCKS 1024                // Cached blocks (4MB budget)
+#define BCACHE_HASH 2048                  // Hash buckets, power of two
+
+typedef struct {
+    uint32_t block_num;
+    int valid;
+    int dirty;
+    int prev, next;                       // LRU list (head = most recently used)
+    int hash_next;                        // Next slot in the same hash bucket
+} BufferHead;
+
+static BufferHead heads[BCACHE_BLOCKS];
+static uint8_t *buffers = NULL;
+static int hash_table[BCACHE_HASH];
+static int lru_head = -1, lru_tail = -1;
+static BlockCacheStats stats;
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_block_cache() {
+    buffers = malloc((size_t)BCACHE_BLOCKS * BLOCK_SIZE);
+    if (!buffers) {
+        fprintf(stderr, "[bcache] Out of memory allocating block cache\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int h = 0; h < BCACHE_HASH; ++h) hash_table[h] = -1;
+    for (int i = 0; i < BCACHE_BLOCKS; ++i) {
+        heads[i].valid = 0;
+        heads[i].dirty = 0;
+        heads[i].prev = i - 1;
+        heads[i].next = (i + 1 < BCACHE_BLOCKS) ? i + 1 : -1;
+        heads[i].hash_next = -1;
+    }
+    lru_head = 0;
+    lru_tail = BCACHE_BLOCKS - 1;
+}
+
+static uint8_t *slot_data(int slot) {
+    return buffers + (size_t)slot * BLOCK_SIZE;
+}
+
+/**
+ * Read a block from the journal or its segment file. Returns -1 (with `buf`
+ * zeroed for an invalid block number) if the copy in the segment file fails
+ * its checksum or the block does not exist.
+ */
+static int disk_read(uint32_t block_num, void *buf) {
+    if (journal_lookup(1, block_num, buf)) return 0;   // Newer than the segment file
+
+    int seg, blk;
+    if (get_segment_and_block_offset(block_num, &seg, &blk) < 0) {
+        memset(buf, 0, BLOCK_SIZE);
+        return -1;
+    }
+    segment_read(1, seg, (size_t)blk * BLOCK_SIZE, buf, BLOCK_SIZE);
+    return checksum_verify(block_num, 1, buf) > 0 ? -1 : 0;
+}
+
+static void disk_write(uint32_t block_num, const void *buf) {
+    int seg, blk;
+    if (get_segment_and_block_offset(block_num, &seg, &blk) < 0) return;
+    segment_write(1, seg, (size_t)blk * BLOCK_SIZE, buf, BLOCK_SIZE);
+    checksum_record(block_num, 1, buf);
+    stats.writebacks++;
+}
+
+static void lru_unlink(int slot) {
+    BufferHead *h = &heads[slot];
+    if (h->prev >= 0) heads[h->prev].next = h->next;
+    else lru_head = h->next;
+    if (h->next >= 0) heads[h->next].prev = h->prev;
+    else lru_tail = h->prev;
+}
+
+static void lru_push_front(int slot) {
+    heads[slot].prev = -1;
+    heads[slot].next = lru_head;
+    if (lru_head >= 0) heads[lru_head].prev = slot;
+    lru_head = slot;
+    if (lru_tail < 0) lru_tail = slot;
+}
+
+static void lru_push_back(int slot) {
+    heads[slot].next = -1;
+    heads[slot].prev = lru_tail;
+    if (lru_tail >= 0) heads[lru_tail].next = slot;
+    lru_tail = slot;
+    if (lru_head < 0) lru_head = slot;
+}
+
+static int hash_slot(uint32_t block_num) {
+    return (int)((block_num * 2654435761u) & (BCACHE_HASH - 1));
+}
+
+static int cache_find(uint32_t block_num) {
+    if (!buffers) init_block_cache();
+    for (int s = hash_table[hash_slot(block_num)]; s >= 0; s = heads[s].hash_next) {
+        if (heads[s].block_num == block_num) return s;
+    }
+    return -1;
+}
+
+static void hash_remove(int slot) {
+    int *link = &hash_table[hash_slot(heads[slot].block_num)];
+    while (*link >= 0 && *link != slot) link = &heads[*link].hash_next;
+    if (*link == slot) *link = heads[slot].hash_next;
+    heads[slot].hash_next = -1;
+}
+
+/**
+ * Drop a slot from the cache, writing it back first if it is dirty.
+ */
+static void release_slot(int slot, int write_back) {
+    BufferHead *h = &heads[slot];
+    if (!h->valid) return;
+    if (h->dirty && write_back) disk_write(h->block_num, slot_data(slot));
+    hash_remove(slot);
+    h->valid = 0;
+    h->dirty = 0;
+    lru_unlink(slot);
+    lru_push_back(slot);   // Free slots are reused first
+}
+
+/**
+ * Return the slot caching `block_num`, loading it from disk when `load` is set.
+ * A loaded block that fails its checksum sets `*corrupt`.
+ */
+static int cache_get(uint32_t block_num, int load, int *corrupt) {
+    int slot = cache_find(block_num);
+    if (slot >= 0) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        slot = lru_tail;
+        if (heads[slot].valid) {
+            stats.evictions++;
+            release_slot(slot, 1);
+        }
+        heads[slot].block_num = block_num;
+        heads[slot].valid = 1;
+        heads[slot].dirty = 0;
+        int h = hash_slot(block_num);
+        heads[slot].hash_next = hash_table[h];
+        hash_table[h] = slot;
+        if (load && disk_read(block_num, slot_data(slot)) < 0) *corrupt = 1;
+    }
+    lru_unlink(slot);
+    lru_push_front(slot);
+    return slot;
+}
+
+/**
+ * Reads one full data block through the cache. Returns -1 if the block fails
+ * its checksum; `buf` still gets the bytes read, but they are not cached.
+ */
+int read_block(uint32_t block_num, void *buf) {
+    int corrupt = 0;
+    pthread_mutex_lock(&bcache_lock);
+    int slot = cache_get(block_num, 1, &corrupt);
+    memcpy(buf, slot_data(slot), BLOCK_SIZE);
+    if (corrupt) release_slot(slot, 0);   // The next read checks the disk again
+    pthread_mutex_unlock(&bcache_lock);
+    return corrupt ? -1 : 0;
+}
+
+/**
+ * Writes one full data block into the cache; it reaches disk on flush or
+ * eviction. Inside a transaction the journal captures it and the cached copy
+ * stays clean: only a checkpoint writes it home.
+ */
+void write_block(uint32_t block_num, const void *buf) {
+    pthread_mutex_lock(&bcache_lock);
+    int unused = 0;
+    int slot = cache_get(block_num, 0, &unused);
+    memcpy(slot_data(slot), buf, BLOCK_SIZE);
+    heads[slot].dirty = !journal_capture(1, block_num, buf);
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+/**
+ * Read `count` contiguous blocks straight from disk (one run within a
+ * segment), using newer cached or journaled copies where they exist. The
+ * blocks are verified as read from the segment file, before those copies
+ * replace them. Returns -1 if any of them fails its checksum, or if the run
+ * does not exist.
+ */
+int read_block_run(uint32_t start, uint32_t count, void *buf) {
+    int seg, blk;
+    if (get_segment_and_block_offset(start, &seg, &blk) < 0) {
+        memset(buf, 0, (size_t)count * BLOCK_SIZE);
+        return -1;
+    }
+    segment_read(1, seg, (size_t)blk * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+    int status = checksum_verify(start, count, buf) > 0 ? -1 : 0;
+
+    pthread_mutex_lock(&bcache_lock);
+    for (uint32_t i = 0; buffers && i < count; ++i) {
+        int slot = cache_find(start + i);
+        uint8_t *dst = (uint8_t *)buf + (size_t)i * BLOCK_SIZE;
+        if (slot >= 0 && heads[slot].dirty) memcpy(dst, slot_data(slot), BLOCK_SIZE);
+        else if (slot < 0) journal_lookup(1, start + i, dst);
+    }
+    pthread_mutex_unlock(&bcache_lock);
+    return status;
+}
+
+/**
+ * Write `count` contiguous blocks straight to disk (one run within a
+ * segment), discarding any cached copies of them.
+ */
+void write_block_run(uint32_t start, uint32_t count, const void *buf) {
+    bcache_invalidate(start, count);
+
+    int seg, blk;
+    if (get_segment_and_block_offset(start, &seg, &blk) < 0) return;
+    segment_write(1, seg, (size_t)blk * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+    checksum_record(start, count, buf);
+}
+
+/**
+ * Hint the kernel to read a block that is about to be needed (no-op if cached).
+ */
+void prefetch_block(uint32_t block_num) {
+    pthread_mutex_lock(&bcache_lock);
+    int cached = buffers && cache_find(block_num) >= 0;
+    pthread_mutex_unlock(&bcache_lock);
+    if (cached) return;
+    int seg, blk;
+    if (get_segment_and_block_offset(block_num, &seg, &blk) < 0) return;
+    posix_fadvise(segment_fd(1, seg), (off_t)blk * BLOCK_SIZE, BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * Write back dirty cached copies of `count` blocks starting at `start`, so
+ * the segment files can be read directly.
+ */
+void bcache_write_back(uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&bcache_lock);
+    for (uint32_t i = 0; buffers && i < count; ++i) {
+        int slot = cache_find(start + i);
+        if (slot >= 0 && heads[slot].dirty) {
+            disk_write(start + i, slot_data(slot));
+            heads[slot].dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+/**
+ * Drop cached copies of `count` blocks starting at `start` without writing
+ * them back (the blocks are about to be rewritten outside the cache).
+ */
+void bcache_invalidate(uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&bcache_lock);
+    for (uint32_t i = 0; buffers && i < count; ++i) {
+        int slot = cache_find(start + i);
+        if (slot >= 0) release_slot(slot, 0);
+    }
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+/**
+ * Return a pointer to `count` contiguous blocks inside the segment mapping
+ * (mmap engine only, NULL otherwise). Dirty cached copies are written back
+ * first so the mapping is current. Valid until the next block access.
+ */
+const uint8_t *block_run_ptr(uint32_t start, uint32_t count) {
+    bcache_write_back(start, count);
+
+    int seg, blk;
+    if (get_segment_and_block_offset(start, &seg, &blk) < 0) return NULL;
+    return segment_ptr(1, seg, (size_t)blk * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+}
+
+static int compare_slots(const void *a, const void *b) {
+    uint32_t x = heads[*(const int *)a].block_num, y = heads[*(const int *)b].block_num;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write every dirty block back in block order and flush the segment files.
+ */
+void bcache_flush() {
+    pthread_mutex_lock(&bcache_lock);
+    if (buffers) {
+        int dirty[BCACHE_BLOCKS];
+        int count = 0;
+        for (int i = 0; i < BCACHE_BLOCKS; ++i) {
+            if (heads[i].valid && heads[i].dirty) dirty[count++] = i;
+        }
+        qsort(dirty, count, sizeof(int), compare_slots);
+        for (int i = 0; i < count; ++i) {
+            disk_write(heads[dirty[i]].block_num, slot_data(dirty[i]));
+            heads[dirty[i]].dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&bcache_lock);
+    flush_all_segments();
+}
+
+/**
+ * Return the cache hit/miss counters.
+ */
+BlockCacheStats bcache_stats() {
+    return stats;
+}
+
+/**
+ * Print the cache counters to stderr.
+ */
+void bcache_report() {
+    uint64_t lookups = stats.hits + stats.misses;
+    fprintf(stderr, "[bcache] %s engine, %d blocks: %llu hits, %llu misses (%.1f%% hit rate), %llu writebacks, %llu evictions\n",
+            segment_io_engine(), BCACHE_BLOCKS, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            lookups ? 100.0 * stats.hits / lookups : 0.0,
+            (unsigned long long)stats.writebacks, (unsigned long long)stats.evictions);
+}
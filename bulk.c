@@ -0,0 +1,381 @@
+// bulk.c
+// Bulk ingest: add every (exfs_path, host_path) pair listed in a manifest in
+// one run. Parent directories and duplicate names are resolved up front, then
+// a pool of worker threads copies file contents in parallel. Each worker owns
+// a whole data segment at a time (reserved from the bitmap under a lock) and
+// writes it through a private descriptor, so workers never share blocks,
+// buffers or the metadata caches. Inodes and directory entries are created
+// afterwards on the main thread, one batch per parent directory.
+// EXFS2_INGEST_THREADS=N overrides the worker count (default: online CPUs).
+
+#include "exfs2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#define BULK_BUFFER_SIZE ((size_t)BLOCKS_PER_SEGMENT * BLOCK_SIZE)   // Host read size per worker (1MB)
+#define MAX_INGEST_THREADS 16
+
+enum { BULK_PENDING, BULK_DONE, BULK_SKIPPED, BULK_FAILED, BULK_DEFERRED };
+
+typedef struct {
+    char *exfs_path;
+    char *host_path;
+    const char *filename;                 // Points into exfs_path
+    int parent;                           // Parent directory inode
+    int status;
+    Inode inode;                          // Built by a worker
+} BulkEntry;
+
+// Data segment currently owned by a worker
+typedef struct {
+    int seg;                              // -1 = none
+    int fd;
+    uint32_t next;                        // Next unused block within the segment
+} Region;
+
+typedef struct {
+    BulkEntry *entries;
+    size_t count;
+    size_t next_entry;                    // Next entry to hand out (under lock)
+    pthread_mutex_t lock;                 // Guards next_entry and the block bitmap
+} BulkJob;
+
+/**
+ * Free the unused tail of a worker's segment and close its descriptor.
+ */
+static void region_release(BulkJob *job, Region *r) {
+    if (r->seg < 0) return;
+    pthread_mutex_lock(&job->lock);
+    for (uint32_t b = r->next; b < BLOCKS_PER_SEGMENT; ++b) mark_block_free((uint32_t)r->seg * BLOCKS_PER_SEGMENT + b);
+    pthread_mutex_unlock(&job->lock);
+    close(r->fd);
+    r->seg = -1;
+}
+
+/**
+ * Give the worker a fresh data segment. Returns -1 if it cannot be opened.
+ */
+static int region_acquire(BulkJob *job, Region *r) {
+    region_release(job, r);
+
+    pthread_mutex_lock(&job->lock);
+    int seg = reserve_data_segment();
+    pthread_mutex_unlock(&job->lock);
+
+    char filename[64];
+    segment_filename(1, seg, filename, sizeof(filename));
+    r->fd = open(filename, O_RDWR);
+    if (r->fd < 0) {
+        perror("[bulk] Failed to open data segment");
+        return -1;
+    }
+    segment_mark_unsynced(seg);   // Written through r->fd, synced before the journal record
+    r->seg = seg;
+    r->next = 1;   // Block 0 of every segment is reserved
+    return 0;
+}
+
+/**
+ * Return a run of blocks [start, start+count) to the bitmap.
+ */
+static void free_run(BulkJob *job, uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&job->lock);
+    for (uint32_t b = 0; b < count; ++b) mark_block_free(start + b);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void free_extents(BulkJob *job, Inode *inode) {
+    for (int e = 0; e < inode->extent_count; ++e) free_run(job, inode->extents[e].start, inode->extents[e].length);
+    inode->extent_count = 0;
+}
+
+/**
+ * Copy one host file into the worker's region, mapping it with extents.
+ * Files that need more extents than the inode holds are handed back as
+ * BULK_DEFERRED for the regular add path.
+ */
+static int ingest_file(BulkJob *job, Region *r, BulkEntry *entry, uint8_t *buf) {
+    int fd = open(entry->host_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "[bulk] Cannot open '%s': %s\n", entry->host_path, strerror(errno));
+        return BULK_FAILED;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+        close(fd);
+        return BULK_DEFERRED;   // Streams and oversized files take the serial path
+    }
+
+    Inode *inode = &entry->inode;
+    memset(inode, 0, sizeof(Inode));
+    inode->type = TYPE_FILE;
+    inode->size = (uint32_t)st.st_size;
+
+    if (inode->size <= inode_inline_capacity()) {
+        // --- Small file: contents live in the inode ---
+        ssize_t got = inode->size ? read(fd, inode->inline_data, inode->size) : 0;
+        close(fd);
+        if (got != (ssize_t)inode->size) {
+            fprintf(stderr, "[bulk] Cannot read '%s': %s\n", entry->host_path,
+                    got < 0 ? strerror(errno) : "file shrank while it was read");
+            return BULK_FAILED;
+        }
+        inode->flags |= INODE_INLINE;
+        return BULK_DONE;
+    }
+
+    inode->flags |= INODE_EXTENTS;
+    uint32_t total_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t remaining = total_blocks;
+    int status = BULK_DONE;
+    while (remaining > 0) {
+        if (r->seg < 0 || r->next == BLOCKS_PER_SEGMENT) {
+            if (region_acquire(job, r) < 0) {
+                status = BULK_FAILED;
+                break;
+            }
+        }
+
+        uint32_t count = BLOCKS_PER_SEGMENT - r->next;
+        if (count > remaining) count = remaining;
+        uint32_t start = (uint32_t)r->seg * BLOCKS_PER_SEGMENT + r->next;
+
+        // --- Extend the last extent or start a new one ---
+        Extent *last = inode->extent_count ? &inode->extents[inode->extent_count - 1] : NULL;
+        if (last && last->start + last->length == start) {
+            last->length += count;
+        } else if (inode->extent_count < inode_extent_capacity()) {
+            Extent *e = &inode->extents[inode->extent_count++];
+            e->logical = last ? last->logical + last->length : 0;
+            e->start = start;
+            e->length = count;
+        } else {
+            status = BULK_DEFERRED;
+            break;
+        }
+        r->next += count;
+
+        // Only the last block may be partial: a short read anywhere else is a
+        // read error or a file that shrank, and must not be stored as zeros
+        size_t len = (size_t)count * BLOCK_SIZE;
+        size_t left = inode->size - (size_t)(total_blocks - remaining) * BLOCK_SIZE;
+        size_t expect = left < len ? left : len;
+        size_t have = 0;
+        ssize_t got = 0;
+        while (have < expect) {
+            got = read(fd, buf + have, expect - have);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            have += got;
+        }
+        if (have < expect) {
+            fprintf(stderr, "[bulk] Cannot read '%s': %s\n", entry->host_path,
+                    got < 0 ? strerror(errno) : "file shrank while it was read");
+            status = BULK_FAILED;
+            break;
+        }
+        memset(buf + have, 0, len - have);   // Zero-pad the last block
+        off_t offset = (off_t)(start % BLOCKS_PER_SEGMENT) * BLOCK_SIZE;
+        if (pwrite(r->fd, buf, len, offset) != (ssize_t)len) {
+            perror("[bulk] Failed to write data segment");
+            status = BULK_FAILED;
+            break;
+        }
+        checksum_record(start, count, buf);
+        remaining -= count;
+    }
+    close(fd);
+
+    if (status != BULK_DONE) free_extents(job, inode);
+    return status;
+}
+
+static void *bulk_worker(void *arg) {
+    BulkJob *job = arg;
+    Region region = { -1, -1, 0 };
+    uint8_t *buf = malloc(BULK_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "[bulk] Out of memory allocating worker buffer\n");
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next_entry;
+        while (i < job->count && job->entries[i].status != BULK_PENDING) ++i;
+        job->next_entry = i + 1;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count) break;
+
+        job->entries[i].status = ingest_file(job, &region, &job->entries[i], buf);
+    }
+
+    region_release(job, &region);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Order entries by parent directory, then name, so duplicates are adjacent
+ * and directory updates are grouped per parent.
+ */
+static int compare_entries(const void *a, const void *b) {
+    const BulkEntry *x = a, *y = b;
+    if (x->parent != y->parent) return (x->parent > y->parent) - (x->parent < y->parent);
+    return strcmp(x->filename, y->filename);
+}
+
+/**
+ * Read the manifest: one "exfs_path host_path" pair per line, blank lines
+ * and lines starting with '#' ignored. The host path runs to the end of the line.
+ */
+static BulkEntry *load_manifest(const char *manifest_path, size_t *count) {
+    FILE *fp = fopen(manifest_path, "r");
+    if (!fp) {
+        perror("[bulk] Failed to open manifest");
+        return NULL;
+    }
+
+    size_t capacity = 256;
+    BulkEntry *entries = malloc(capacity * sizeof(BulkEntry));
+    *count = 0;
+    char line[2 * MAX_PATH];
+    int line_no = 0;
+    while (entries && fgets(line, sizeof(line), fp)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *exfs_path = line + strspn(line, " \t");
+        if (*exfs_path == '\0' || *exfs_path == '#') continue;
+
+        char *host_path = exfs_path + strcspn(exfs_path, " \t");
+        if (*host_path) *host_path++ = '\0';
+        host_path += strspn(host_path, " \t");
+        if (*exfs_path != '/' || *host_path == '\0') {
+            fprintf(stderr, "[bulk] Manifest line %d: expected '<exfs_path> <host_path>'\n", line_no);
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            BulkEntry *grown = realloc(entries, capacity * sizeof(BulkEntry));
+            if (!grown) {
+                free(entries);
+                entries = NULL;
+                break;
+            }
+            entries = grown;
+        }
+        BulkEntry *e = &entries[(*count)++];
+        memset(e, 0, sizeof(BulkEntry));
+        e->exfs_path = strdup(exfs_path);
+        e->host_path = strdup(host_path);
+    }
+    fclose(fp);
+
+    if (!entries) fprintf(stderr, "[bulk] Out of memory reading manifest\n");
+    return entries;
+}
+
+static int ingest_threads() {
+    const char *env = getenv("EXFS2_INGEST_THREADS");
+    long threads = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > MAX_INGEST_THREADS) threads = MAX_INGEST_THREADS;
+    return (int)threads;
+}
+
+/**
+ * Add every file listed in a manifest, copying contents with a pool of
+ * worker threads. Returns 0 if every entry was added, -1 if the manifest
+ * cannot be read or any entry failed (duplicates are only ignored).
+ */
+int run_bulk_add(const char *manifest_path) {
+    size_t count;
+    BulkEntry *entries = load_manifest(manifest_path, &count);
+    if (!entries) return -1;
+    journal_begin();   // The whole manifest commits as one transaction
+
+    // --- Resolve parents and reject existing names (serial, metadata only) ---
+    for (size_t i = 0; i < count; ++i) {
+        BulkEntry *e = &entries[i];
+        const char *slash = strrchr(e->exfs_path, '/');
+        e->filename = slash + 1;
+        e->status = BULK_FAILED;
+        if (*e->filename == '\0') {
+            fprintf(stderr, "[bulk] Invalid path '%s': missing filename\n", e->exfs_path);
+            continue;
+        }
+        e->parent = find_or_create_path(e->exfs_path);
+        if (e->parent < 0) {
+            fprintf(stderr, "[bulk] Failed to resolve parent of '%s'\n", e->exfs_path);
+        } else if (dir_lookup(e->parent, e->filename) >= 0) {
+            fprintf(stderr, "[bulk] '%s' already exists\n", e->exfs_path);
+        } else {
+            e->status = BULK_PENDING;
+        }
+    }
+
+    qsort(entries, count, sizeof(BulkEntry), compare_entries);
+    for (size_t i = 1; i < count; ++i) {
+        if (entries[i].status == BULK_PENDING && entries[i - 1].parent == entries[i].parent &&
+            strcmp(entries[i - 1].filename, entries[i].filename) == 0) {
+            fprintf(stderr, "[bulk] '%s' listed more than once, ignoring the duplicate\n", entries[i].exfs_path);
+            entries[i].status = BULK_SKIPPED;
+        }
+    }
+
+    // Workers write segments behind the caches' back: start from clean caches
+    bcache_flush();
+    close_all_segments();
+
+    // --- Copy file contents in parallel ---
+    BulkJob job = { entries, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    int threads = ingest_threads();
+    pthread_t workers[MAX_INGEST_THREADS];
+    for (int t = 0; t < threads; ++t) pthread_create(&workers[t], NULL, bulk_worker, &job);
+    for (int t = 0; t < threads; ++t) pthread_join(workers[t], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    // Regions were reserved without going through the block cache
+    for (int s = 0; s < num_data_segments; ++s) bcache_invalidate((uint32_t)s * BLOCKS_PER_SEGMENT, BLOCKS_PER_SEGMENT);
+
+    // --- Create inodes and link them, one parent directory at a time ---
+    size_t added = 0, failed = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        BulkEntry *e = &entries[i];
+        if (e->status == BULK_DEFERRED) {
+            if (run_add(e->exfs_path, e->host_path) < 0) failed++;
+            continue;
+        }
+        if (e->status == BULK_FAILED) failed++;
+        if (e->status != BULK_DONE) continue;
+
+        int inode_num = find_free_inode();
+        write_inode(inode_num, &e->inode);
+        if (dir_insert(e->parent, e->filename, inode_num) != 0) {
+            fprintf(stderr, "[bulk] Failed to link '%s' into its directory\n", e->exfs_path);
+            release_file_blocks(&e->inode);
+            clear_inode(inode_num);
+            mark_inode_free(inode_num);
+            failed++;
+            continue;
+        }
+        added++;
+        bytes += e->inode.size;
+    }
+
+    journal_commit();
+    fprintf(stderr, "[bulk] Added %zu files (%.1f MB) with %d threads, %zu failed\n",
+            added, bytes / (1024.0 * 1024.0), threads, failed);
+
+    for (size_t i = 0; i < count; ++i) {
+        free(entries[i].exfs_path);
+        free(entries[i].host_path);
+    }
+    free(entries);
+    return failed ? -1 : 0;
+}
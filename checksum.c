@@ -0,0 +1,462 @@
+// checksum.c
+// Per-block CRC32C checksums. Each data segment has a checksum area in
+// checksums.seg (after a small header, the area of segment n starts at
+// n * CHECKSUM_AREA_SIZE): a CRC per block plus a bitmap of the blocks that
+// have one, so a block whose CRC happens to be 0 is still verified. An entry
+// is updated whenever its block is written to the segment file, and the areas
+// are written back at each checkpoint. Entries changed since then are also
+// logged in the next journal record, so replay restores them together with
+// the blocks they describe.
+//
+// Reads that pass through memory (block cache misses, block runs, and the
+// buffered and parallel extract paths) are verified against the areas.
+// EXFS2_VERIFY=0 turns verification off, which also lets extract use the
+// zero-copy paths again. scrub (-V) verifies every allocated block, one whole
+// segment at a time per thread (EXFS2_SCRUB_THREADS overrides the count).
+//
+// CRC32C uses the SSE4.2 crc32 instruction when the CPU has it and a lookup
+// table otherwise.
+
+#include "exfs2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#define CHECKSUM_FILE "checksums.seg"
+#define CHECKSUM_MAGIC 0x4b435845u                                   // "EXCK"
+#define CHECKSUM_AREA_SIZE sizeof(ChecksumArea)                      // Bytes per segment (1056)
+#define CRC32C_POLY 0x82f63b78u                                      // Reflected Castagnoli polynomial
+#define MAX_SCRUB_THREADS 16
+#define MAX_REPORTED_ERRORS 16                                       // Bad blocks listed per verify call
+
+// On-disk header of checksums.seg, followed by the areas
+typedef struct {
+    uint32_t magic;                       // CHECKSUM_MAGIC
+    uint32_t area_size;                   // CHECKSUM_AREA_SIZE
+} ChecksumHeader;
+
+// Checksums of one data segment
+typedef struct {
+    uint32_t crc[BLOCKS_PER_SEGMENT];
+    uint64_t valid[BLOCKS_PER_SEGMENT / 64];   // Blocks with a recorded checksum
+} ChecksumArea;
+
+static int checksum_fd = -1;
+static int file_existed = 0;
+static ChecksumArea **areas = NULL;       // Checksum area of each data segment, loaded on first use
+static uint8_t *area_dirty = NULL;
+static int areas_tracked = 0;
+static ChecksumUpdate *pending = NULL;    // Entries changed since the last checkpoint, in order
+static size_t pending_count = 0, pending_capacity = 0;
+static int verify = -1;                   // From EXFS2_VERIFY
+static pthread_mutex_t checksum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// --- CRC32C ---
+
+static uint32_t crc_table[256];
+static uint32_t (*crc_update)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = (uint32_t)c;
+    while (len--) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+static void init_crc() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[i] = c;
+    }
+    crc_update = crc32c_table;
+#if defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc_update = crc32c_sse42;
+#endif
+}
+
+/**
+ * Return the CRC32C of `len` bytes.
+ */
+uint32_t crc32c(const void *data, size_t len) {
+    pthread_once(&crc_once, init_crc);
+    return ~crc_update(~0u, data, len);
+}
+
+/**
+ * Name of the CRC32C implementation in use.
+ */
+const char *crc32c_engine() {
+    pthread_once(&crc_once, init_crc);
+    return crc_update == crc32c_table ? "table" : "sse4.2";
+}
+
+// --- Checksum areas ---
+
+static off_t area_offset(int seg) {
+    return (off_t)sizeof(ChecksumHeader) + (off_t)seg * CHECKSUM_AREA_SIZE;
+}
+
+/**
+ * Open checksums.seg, starting it over (with `file_existed` cleared, so it
+ * is recomputed) if it is missing or in another format.
+ */
+static void open_checksum_file() {
+    file_existed = access(CHECKSUM_FILE, F_OK) == 0;
+    checksum_fd = open(CHECKSUM_FILE, O_RDWR | O_CREAT, 0644);
+    if (checksum_fd < 0) {
+        perror("[checksum] Failed to open checksum file");
+        exit(EXIT_FAILURE);
+    }
+
+    ChecksumHeader header = {0};
+    if (pread(checksum_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && header.magic == CHECKSUM_MAGIC &&
+        header.area_size == CHECKSUM_AREA_SIZE) {
+        return;
+    }
+    if (file_existed) fprintf(stderr, "[checksum] %s has an older format, recomputing it\n", CHECKSUM_FILE);
+    file_existed = 0;
+    header = (ChecksumHeader){ CHECKSUM_MAGIC, CHECKSUM_AREA_SIZE };
+    if (ftruncate(checksum_fd, 0) != 0 || pwrite(checksum_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        perror("[checksum] Failed to initialize checksum file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int has_checksum(const ChecksumArea *a, uint32_t b) {
+    return (a->valid[b / 64] >> (b % 64)) & 1;
+}
+
+static void set_checksum(ChecksumArea *a, uint32_t b, uint32_t crc) {
+    a->crc[b] = crc;
+    a->valid[b / 64] |= 1ULL << (b % 64);
+}
+
+static void clear_checksum(ChecksumArea *a, uint32_t b) {
+    a->crc[b] = 0;
+    a->valid[b / 64] &= ~(1ULL << (b % 64));
+}
+
+/**
+ * Return the checksum area of data segment `seg`, reading it from
+ * checksums.seg on first use (missing areas have no checksums). Called with
+ * checksum_lock held.
+ */
+static ChecksumArea *area(int seg) {
+    if (seg >= areas_tracked) {
+        int capacity = areas_tracked ? areas_tracked : 64;
+        while (capacity <= seg) capacity *= 2;
+        ChecksumArea **grown = realloc(areas, (size_t)capacity * sizeof(ChecksumArea *));
+        uint8_t *dirty = grown ? realloc(area_dirty, capacity) : NULL;
+        if (!grown || !dirty) {
+            fprintf(stderr, "[checksum] Out of memory for checksum areas\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown + areas_tracked, 0, (size_t)(capacity - areas_tracked) * sizeof(ChecksumArea *));
+        memset(dirty + areas_tracked, 0, capacity - areas_tracked);
+        areas = grown;
+        area_dirty = dirty;
+        areas_tracked = capacity;
+    }
+    if (areas[seg]) return areas[seg];
+
+    if (checksum_fd < 0) open_checksum_file();
+    areas[seg] = calloc(1, sizeof(ChecksumArea));
+    if (!areas[seg]) {
+        fprintf(stderr, "[checksum] Out of memory for checksum areas\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pread(checksum_fd, areas[seg], CHECKSUM_AREA_SIZE, area_offset(seg)) < 0) {
+        perror("[checksum] Failed to read checksum area");
+    }
+    return areas[seg];
+}
+
+/**
+ * Return 1 unless verification is turned off (EXFS2_VERIFY=0).
+ */
+int checksum_verify_enabled() {
+    if (verify < 0) {
+        const char *env = getenv("EXFS2_VERIFY");
+        verify = !env || strcmp(env, "0") != 0;
+    }
+    return verify;
+}
+
+/**
+ * Record the checksums of `count` blocks starting at `start` that were just
+ * written to their segment file (one run within a segment). Safe to call from
+ * worker threads.
+ */
+void checksum_record(uint32_t start, uint32_t count, const void *buf) {
+    uint32_t crcs[BLOCKS_PER_SEGMENT];
+    for (uint32_t i = 0; i < count; ++i) crcs[i] = crc32c((const uint8_t *)buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+
+    pthread_mutex_lock(&checksum_lock);
+    int seg = start / BLOCKS_PER_SEGMENT;
+    ChecksumArea *a = area(seg);
+    for (uint32_t i = 0; i < count; ++i) set_checksum(a, start % BLOCKS_PER_SEGMENT + i, crcs[i]);
+    area_dirty[seg] = 1;
+
+    if (pending_count + count > pending_capacity) {
+        while (pending_count + count > pending_capacity) pending_capacity = pending_capacity ? pending_capacity * 2 : 1024;
+        pending = realloc(pending, pending_capacity * sizeof(ChecksumUpdate));
+        if (!pending) {
+            fprintf(stderr, "[checksum] Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint32_t i = 0; i < count; ++i) pending[pending_count++] = (ChecksumUpdate){ start + i, crcs[i] };
+    pthread_mutex_unlock(&checksum_lock);
+}
+
+/**
+ * Set one checksum entry (journal replay).
+ */
+void checksum_set(uint32_t block_num, uint32_t crc) {
+    pthread_mutex_lock(&checksum_lock);
+    int seg = block_num / BLOCKS_PER_SEGMENT;
+    set_checksum(area(seg), block_num % BLOCKS_PER_SEGMENT, crc);
+    area_dirty[seg] = 1;
+    pthread_mutex_unlock(&checksum_lock);
+}
+
+/**
+ * Forget the checksums of `count` blocks starting at `start` (one run within
+ * a segment), for blocks whose contents are gone.
+ */
+void checksum_clear(uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&checksum_lock);
+    int seg = start / BLOCKS_PER_SEGMENT;
+    ChecksumArea *a = area(seg);
+    for (uint32_t i = 0; i < count; ++i) clear_checksum(a, start % BLOCKS_PER_SEGMENT + i);
+    area_dirty[seg] = 1;
+    pthread_mutex_unlock(&checksum_lock);
+}
+
+/**
+ * Hand the entries changed since the last call (or checkpoint) to the
+ * journal. Returns a malloc'd array the caller frees, or NULL if there are none.
+ */
+ChecksumUpdate *checksum_take_pending(size_t *count) {
+    pthread_mutex_lock(&checksum_lock);
+    ChecksumUpdate *taken = pending;
+    *count = pending_count;
+    pending = NULL;
+    pending_count = pending_capacity = 0;
+    pthread_mutex_unlock(&checksum_lock);
+    return taken;
+}
+
+/**
+ * Check `count` blocks starting at `start` (one run within a segment) read
+ * straight from their segment file. Mismatches are reported on stderr.
+ * Returns the number of corrupt blocks.
+ */
+int checksum_verify(uint32_t start, uint32_t count, const void *buf) {
+    if (!checksum_verify_enabled() || count == 0) return 0;
+
+    ChecksumArea expected;
+    pthread_mutex_lock(&checksum_lock);
+    memcpy(&expected, area(start / BLOCKS_PER_SEGMENT), sizeof(expected));
+    pthread_mutex_unlock(&checksum_lock);
+
+    int bad = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t b = start % BLOCKS_PER_SEGMENT + i;
+        if (!has_checksum(&expected, b)) continue;
+        uint32_t crc = crc32c((const uint8_t *)buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        if (crc == expected.crc[b]) continue;
+        if (bad++ < MAX_REPORTED_ERRORS) {
+            fprintf(stderr, "[checksum] Block %u is corrupt: checksum %08x, expected %08x\n", start + i, crc, expected.crc[b]);
+        }
+    }
+    return bad;
+}
+
+/**
+ * Recompute the entries of every allocated block from the segment files.
+ */
+static void recompute_checksums() {
+    uint8_t *buf = malloc(SEGMENT_SIZE);
+    if (!buf) {
+        fprintf(stderr, "[checksum] Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int s = 0; s < num_data_segments; ++s) {
+        segment_read(1, s, 0, buf, SEGMENT_SIZE);
+        pthread_mutex_lock(&checksum_lock);
+        ChecksumArea *a = area(s);
+        for (uint32_t b = 0; b < BLOCKS_PER_SEGMENT; ++b) {
+            uint32_t block_num = (uint32_t)s * BLOCKS_PER_SEGMENT + b;
+            if (block_is_used(block_num)) set_checksum(a, b, crc32c(buf + (size_t)b * BLOCK_SIZE, BLOCK_SIZE));
+            else clear_checksum(a, b);
+        }
+        area_dirty[s] = 1;
+        pthread_mutex_unlock(&checksum_lock);
+    }
+    free(buf);
+}
+
+/**
+ * Open the checksum areas at mount. They are recomputed from the segment
+ * files when `rebuild` is set (unclean shutdown without a journal) or when
+ * the filesystem predates checksums.
+ */
+void checksum_load(int rebuild) {
+    pthread_mutex_lock(&checksum_lock);
+    area(0);
+    int existed = file_existed;
+    pthread_mutex_unlock(&checksum_lock);
+
+    if (!rebuild && existed) return;
+    recompute_checksums();
+    if (existed) fprintf(stderr, "[checksum] Recomputed block checksums of %d segments\n", num_data_segments);
+    checksum_sync();
+}
+
+/**
+ * Write changed checksum areas back to checksums.seg and make them durable.
+ * Called at every checkpoint, after which the journal no longer needs the
+ * pending entries.
+ */
+void checksum_sync() {
+    pthread_mutex_lock(&checksum_lock);
+    int wrote = 0;
+    for (int s = 0; s < areas_tracked; ++s) {
+        if (!area_dirty[s]) continue;
+        if (pwrite(checksum_fd, areas[s], CHECKSUM_AREA_SIZE, area_offset(s)) != (ssize_t)CHECKSUM_AREA_SIZE) {
+            perror("[checksum] Failed to write checksum area");
+            continue;
+        }
+        area_dirty[s] = 0;
+        wrote = 1;
+    }
+    if (wrote && fdatasync(checksum_fd) != 0) perror("[checksum] fdatasync failed");
+    pending_count = 0;
+    pthread_mutex_unlock(&checksum_lock);
+}
+
+// --- Scrub ---
+
+typedef struct {
+    int next_seg;                         // Next segment to hand out (under lock)
+    uint64_t verified, unchecked, corrupt;
+    pthread_mutex_t lock;
+} ScrubJob;
+
+/**
+ * Verify every allocated block of one segment read through a private descriptor.
+ */
+static void scrub_segment(ScrubJob *job, int seg, uint8_t *buf) {
+    char filename[64];
+    segment_filename(1, seg, filename, sizeof(filename));
+    int fd = open(filename, O_RDONLY);
+    size_t got = 0;
+    while (fd >= 0 && got < SEGMENT_SIZE) {
+        ssize_t n = pread(fd, buf + got, SEGMENT_SIZE - got, (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    if (fd < 0) perror("[scrub] Failed to open data segment");
+    else close(fd);
+    memset(buf + got, 0, SEGMENT_SIZE - got);   // Blocks past the end of the file read as zeros
+
+    ChecksumArea expected;
+    pthread_mutex_lock(&checksum_lock);
+    memcpy(&expected, area(seg), sizeof(expected));
+    pthread_mutex_unlock(&checksum_lock);
+
+    uint64_t verified = 0, unchecked = 0, corrupt = 0;
+    for (uint32_t b = 0; b < BLOCKS_PER_SEGMENT; ++b) {
+        uint32_t block_num = (uint32_t)seg * BLOCKS_PER_SEGMENT + b;
+        if (!block_is_used(block_num) || (b == 0 && seg > 0)) continue;   // Reserved blocks are never written
+        if (!has_checksum(&expected, b)) {
+            unchecked++;
+            continue;
+        }
+        uint32_t crc = crc32c(buf + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+        verified++;
+        if (crc != expected.crc[b]) {
+            corrupt++;
+            fprintf(stderr, "[scrub] Block %u (segment %d, block %u) is corrupt: checksum %08x, expected %08x\n",
+                    block_num, seg, b, crc, expected.crc[b]);
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->verified += verified;
+    job->unchecked += unchecked;
+    job->corrupt += corrupt;
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *scrub_worker(void *arg) {
+    ScrubJob *job = arg;
+    uint8_t *buf = malloc(SEGMENT_SIZE);
+    if (!buf) {
+        fprintf(stderr, "[scrub] Out of memory allocating worker buffer\n");
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int seg = job->next_seg < num_data_segments ? job->next_seg++ : -1;
+        pthread_mutex_unlock(&job->lock);
+        if (seg < 0) break;
+        scrub_segment(job, seg, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int scrub_threads() {
+    const char *env = getenv("EXFS2_SCRUB_THREADS");
+    long threads = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > MAX_SCRUB_THREADS) threads = MAX_SCRUB_THREADS;
+    if (threads > num_data_segments) threads = num_data_segments;
+    return (int)threads;
+}
+
+/**
+ * Verify the checksum of every allocated block in every data segment with a
+ * pool of threads. Returns the number of corrupt blocks.
+ */
+uint64_t run_scrub() {
+    bcache_flush();   // Workers read the segment files directly
+
+    ScrubJob job = { 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    int threads = scrub_threads();
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t workers[MAX_SCRUB_THREADS];
+    for (int t = 0; t < threads; ++t) pthread_create(&workers[t], NULL, scrub_worker, &job);
+    for (int t = 0; t < threads; ++t) pthread_join(workers[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_mutex_destroy(&job.lock);
+
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double mb = (double)num_data_segments * SEGMENT_SIZE / (1024.0 * 1024.0);
+    fprintf(stderr, "[scrub] %d segments (%.0f MB) in %.2fs with %d threads (%s CRC32C, %.0f MB/s)\n",
+            num_data_segments, mb, seconds, threads, crc32c_engine(), seconds > 0 ? mb / seconds : 0.0);
+    fprintf(stderr, "[scrub] %llu blocks verified, %llu corrupt, %llu without checksum\n",
+            (unsigned long long)job.verified, (unsigned long long)job.corrupt, (unsigned long long)job.unchecked);
+    return job.corrupt;
+}
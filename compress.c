@@ -0,0 +1,195 @@
+// compress.c
+// Transparent compression for add (EXFS2_COMPRESS=1). A compressed file is cut
+// into chunks of COMPRESS_CHUNK_SIZE bytes; each chunk is packed with a small
+// built-in LZ codec into as few whole blocks as it needs (or stored raw when
+// packing saves nothing) in one contiguous run. The runs are listed in chunk
+// table blocks, which the inode maps like data blocks through its direct and
+// indirect pointers, so chunk i is found from its index alone.
+//
+// Codec format, a sequence of:
+//   token     high nibble: literal count, low nibble: match length - 4
+//             (15 in either means more length bytes follow, each adding up to 255)
+//   literals  copied as is
+//   offset    2 bytes, little-endian distance back to the match
+// The last sequence has literals only.
+
+#include "exfs2.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 8                    // Input tail always emitted as literals
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * Append a length that did not fit its 4-bit token field. Returns -1 if
+ * `dst` is full.
+ */
+static int put_length(uint8_t *dst, size_t *op, size_t cap, size_t n) {
+    while (n >= 255) {
+        if (*op >= cap) return -1;
+        dst[(*op)++] = 255;
+        n -= 255;
+    }
+    if (*op >= cap) return -1;
+    dst[(*op)++] = (uint8_t)n;
+    return 0;
+}
+
+/**
+ * Emit one sequence: `lit` literals from `literals`, then a match of `match`
+ * bytes at `offset` back (no match when `match` is 0). Returns -1 if `dst` is full.
+ */
+static int put_sequence(uint8_t *dst, size_t *op, size_t cap, const uint8_t *literals, size_t lit,
+                        size_t offset, size_t match) {
+    size_t match_code = match ? match - LZ_MIN_MATCH : 0;
+    if (*op >= cap) return -1;
+    dst[(*op)++] = (uint8_t)((lit < 15 ? lit : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (lit >= 15 && put_length(dst, op, cap, lit - 15) < 0) return -1;
+
+    if (lit > cap - *op) return -1;
+    memcpy(dst + *op, literals, lit);
+    *op += lit;
+    if (!match) return 0;
+
+    if (cap - *op < 2) return -1;
+    dst[(*op)++] = (uint8_t)(offset & 0xff);
+    dst[(*op)++] = (uint8_t)(offset >> 8);
+    if (match_code >= 15 && put_length(dst, op, cap, match_code - 15) < 0) return -1;
+    return 0;
+}
+
+/**
+ * Compress `len` bytes into `dst`. Returns the compressed size, or 0 if it
+ * would not fit in `cap` bytes. Positions that keep missing are skipped
+ * faster, so incompressible data costs little.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0};   // Last position + 1 of each 4-byte hash
+    size_t ip = 0, anchor = 0, op = 0;
+
+    while (ip + LZ_LAST_LITERALS <= len) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)ip + 1;
+
+        if (candidate == 0 || ip - (candidate - 1) > LZ_MAX_OFFSET || read32(src + candidate - 1) != seq) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t ref = candidate - 1;
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match < len && src[ref + match] == src[ip + match]) match++;
+        if (put_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - ref, match) < 0) return 0;
+        ip += match;
+        anchor = ip;
+    }
+
+    if (put_sequence(dst, &op, cap, src + anchor, len - anchor, 0, 0) < 0) return 0;
+    return op;
+}
+
+/**
+ * Read a length continued past its 4-bit token field. Returns -1 if the
+ * input ends first.
+ */
+static int get_length(const uint8_t *src, size_t len, size_t *ip, size_t *n) {
+    uint8_t b;
+    do {
+        if (*ip >= len) return -1;
+        b = src[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * Decompress `len` bytes into exactly `out_len` bytes of `dst`. Returns -1 if
+ * the input is damaged; nothing outside `dst` is ever written.
+ */
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len) {
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(src, len, &ip, &lit) < 0) return -1;
+        if (lit > len - ip || lit > out_len - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len) break;
+
+        if (len - ip < 2) return -1;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && get_length(src, len, &ip, &match) < 0) return -1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match > out_len - op) return -1;
+        for (size_t i = 0; i < match; ++i) dst[op + i] = dst[op - offset + i];   // May overlap
+        op += match;
+    }
+    return op == out_len ? 0 : -1;
+}
+
+/**
+ * Return 1 if add should store new files compressed (EXFS2_COMPRESS=1).
+ */
+int compress_enabled() {
+    static int enabled = -1;
+    if (enabled < 0) {
+        const char *env = getenv("EXFS2_COMPRESS");
+        enabled = env && strcmp(env, "0") != 0;
+    }
+    return enabled;
+}
+
+/**
+ * Return the number of blocks a chunk's stored run occupies.
+ */
+uint32_t chunk_blocks(const CompressedChunk *chunk) {
+    return ((chunk->stored & ~CHUNK_RAW) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * Visit the chunks listed under a pointer `levels` deep (0 = a chunk table
+ * block). Returns non-zero once the visitor asks to stop or the table ends.
+ */
+static int visit_tables(uint32_t block_num, int levels, ChunkVisitor visit, void *ctx) {
+    if (block_num == 0) return 1;
+    if (levels == 0) {
+        CompressedChunk table[CHUNKS_PER_TABLE];
+        read_block(block_num, table);
+        for (size_t i = 0; i < CHUNKS_PER_TABLE; ++i) {
+            if (table[i].start == 0) return 1;
+            if (visit(&table[i], ctx)) return 1;
+        }
+        return 0;
+    }
+
+    uint32_t ptrs[PTRS_PER_BLOCK] = {0};
+    extract_block_list(block_num, ptrs, PTRS_PER_BLOCK);
+    for (size_t i = 0; i < PTRS_PER_BLOCK; ++i) {
+        if (visit_tables(ptrs[i], levels - 1, visit, ctx)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Call `visit` for every chunk of a compressed file, in file order.
+ */
+void compressed_foreach(const Inode *inode, ChunkVisitor visit, void *ctx) {
+    for (int i = 0; i < DIRECT_BLOCKS; ++i) {
+        if (visit_tables(inode->direct[i], 0, visit, ctx)) return;
+    }
+    if (visit_tables(inode->indirect_single, 1, visit, ctx)) return;
+    if (visit_tables(inode->indirect_double, 2, visit, ctx)) return;
+    visit_tables(inode->large.indirect_triple, 3, visit, ctx);
+}
@@ -2,10 +2,30 @@
 #include <stdio.h>
 #include <string.h>
 
+static int print_entry(uint32_t inode_num, const char *name, void *ctx) {
+    fprintf(ctx, "  - '%s' (inode %u)\n", name, inode_num);
+    return 0;
+}
+
+// Totals over the chunks of a compressed file
+typedef struct {
+    uint32_t chunks;
+    uint32_t raw;
+    uint64_t blocks;
+} ChunkStats;
+
+static int count_chunk(const CompressedChunk *chunk, void *ctx) {
+    ChunkStats *stats = ctx;
+    stats->chunks++;
+    stats->raw += (chunk->stored & CHUNK_RAW) != 0;
+    stats->blocks += chunk_blocks(chunk);
+    return 0;
+}
+
 /**
- * Print detailed information about a file or directory inode.
+ * Print detailed information about a file or directory inode to `out`.
  */
-void run_debug(const char *exfs_path) {
+void run_debug(const char *exfs_path, FILE *out) {
     fprintf(stderr, "[debug] Debugging '%s'\n", exfs_path);
 
     // Step 1: Resolve the inode for the given path
@@ -16,75 +36,110 @@ void run_debug(const char *exfs_path) {
     }
 
     // Step 2: Load inode from its segment
-    int seg, off;
-    get_segment_and_inode_offset(inode_num, &seg, &off);
-
     Inode inode;
-    fseek(inode_segments[seg], off * sizeof(Inode), SEEK_SET);
-    fread(&inode, sizeof(Inode), 1, inode_segments[seg]);
+    read_inode(inode_num, &inode);
 
     // Step 3: Display inode basic metadata
-    printf("Inode %d Info:\n", inode_num);
-    printf("  Type : %s\n", inode.type == TYPE_DIR ? "Directory" :
+    fprintf(out, "Inode %d Info:\n", inode_num);
+    fprintf(out, "  Type : %s\n", inode.type == TYPE_DIR ? "Directory" :
                               inode.type == TYPE_FILE ? "File" : "Unknown");
-    printf("  Size : %u bytes\n", inode.size);
+    fprintf(out, "  Size : %llu bytes\n", (unsigned long long)inode_file_size(&inode));
 
-    // Step 4: Print direct blocks
-    printf("  Direct blocks:\n");
-    for (int i = 0; i < DIRECT_BLOCKS; i++) {
-        if (inode.direct[i]) {
-            printf("    [%d] -> Block %u\n", i, inode.direct[i]);
+    // Step 4: Print inline data, extents or direct blocks
+    if (inode.flags & INODE_INLINE) {
+        fprintf(out, "  Inline data: %u bytes stored in inode\n", inode.size);
+    } else if (inode.flags & INODE_EXTENTS) {
+        fprintf(out, "  Extents (%u):\n", inode.extent_count);
+        for (int i = 0; i < inode.extent_count; i++) {
+            fprintf(out, "    [%d] file block %u -> Blocks %u-%u (%u blocks)\n", i, inode.extents[i].logical,
+                   inode.extents[i].start, inode.extents[i].start + inode.extents[i].length - 1,
+                   inode.extents[i].length);
+        }
+    } else if (inode.flags & INODE_COMPRESSED) {
+        ChunkStats stats = {0};
+        compressed_foreach(&inode, count_chunk, &stats);
+        fprintf(out, "  Compressed: %u chunks of %dKB (%u stored raw) in %llu blocks\n", stats.chunks,
+                COMPRESS_CHUNK_SIZE / 1024, stats.raw, (unsigned long long)stats.blocks);
+        fprintf(out, "  Chunk table blocks:\n");
+        for (int i = 0; i < DIRECT_BLOCKS; i++) {
+            if (inode.direct[i]) {
+                fprintf(out, "    [%d] -> Block %u\n", i, inode.direct[i]);
+            }
+        }
+    } else {
+        fprintf(out, "  Direct blocks:\n");
+        for (int i = 0; i < DIRECT_BLOCKS; i++) {
+            if (inode.direct[i]) {
+                fprintf(out, "    [%d] -> Block %u\n", i, inode.direct[i]);
+            }
         }
     }
 
     // Step 5: Print single indirect block contents
     if (inode.indirect_single != 0) {
-        printf("  Single Indirect Block: %u\n", inode.indirect_single);
+        fprintf(out, "  Single Indirect Block: %u\n", inode.indirect_single);
         uint32_t blocks[PTRS_PER_BLOCK] = {0};
         extract_block_list(inode.indirect_single, blocks, PTRS_PER_BLOCK);
         for (int i = 0; i < PTRS_PER_BLOCK; ++i) {
-            if (blocks[i] == 0) break;
-            printf("    -> %u\n", blocks[i]);
+            if (blocks[i] == 0) continue;   // Hole
+            fprintf(out, "    -> %u\n", blocks[i]);
         }
     }
 
     // Step 6: Print double indirect block contents
     if (inode.indirect_double != 0) {
-        printf("  Double Indirect Block: %u\n", inode.indirect_double);
+        fprintf(out, "  Double Indirect Block: %u\n", inode.indirect_double);
         uint32_t level1[PTRS_PER_BLOCK] = {0};
         extract_block_list(inode.indirect_double, level1, PTRS_PER_BLOCK);
 
         for (int i = 0; i < PTRS_PER_BLOCK; ++i) {
-            if (level1[i] == 0) break;
+            if (level1[i] == 0) continue;
 
-            printf("    -> Indirect Block %u\n", level1[i]);
+            fprintf(out, "    -> Indirect Block %u\n", level1[i]);
             uint32_t level2[PTRS_PER_BLOCK] = {0};
             extract_block_list(level1[i], level2, PTRS_PER_BLOCK);
 
             for (int j = 0; j < PTRS_PER_BLOCK; ++j) {
-                if (level2[j] == 0) break;
-                printf("        -> %u\n", level2[j]);
+                if (level2[j] == 0) continue;
+                fprintf(out, "        -> %u\n", level2[j]);
             }
         }
     }
 
-    // Step 7: If it's a directory, print its entries
-    if (inode.type == TYPE_DIR) {
-        printf("Directory Entries:\n");
+    // Step 7: Print the triple indirect tree, one line per pointer block
+    if (inode.type == TYPE_FILE && !(inode.flags & (INODE_EXTENTS | INODE_INLINE)) && inode.large.indirect_triple != 0) {
+        fprintf(out, "  Triple Indirect Block: %u\n", inode.large.indirect_triple);
+        uint32_t level1[PTRS_PER_BLOCK] = {0};
+        extract_block_list(inode.large.indirect_triple, level1, PTRS_PER_BLOCK);
 
-        int blk_seg, blk_off;
-        get_segment_and_block_offset(inode.direct[0], &blk_seg, &blk_off);
+        for (int i = 0; i < PTRS_PER_BLOCK; ++i) {
+            if (level1[i] == 0) continue;
+            fprintf(out, "    -> Double Indirect Block %u\n", level1[i]);
+            uint32_t level2[PTRS_PER_BLOCK] = {0};
+            extract_block_list(level1[i], level2, PTRS_PER_BLOCK);
 
-        char block[BLOCK_SIZE];
-        fseek(data_segments[blk_seg], blk_off * BLOCK_SIZE, SEEK_SET);
-        fread(block, BLOCK_SIZE, 1, data_segments[blk_seg]);
+            for (int j = 0; j < PTRS_PER_BLOCK; ++j) {
+                if (level2[j] == 0) continue;
+                uint32_t level3[PTRS_PER_BLOCK] = {0};
+                extract_block_list(level2[j], level3, PTRS_PER_BLOCK);
+                int used = 0;
+                for (int k = 0; k < PTRS_PER_BLOCK; ++k) used += level3[k] != 0;
+                fprintf(out, "        -> Indirect Block %u (%d data blocks)\n", level2[j], used);
+            }
+        }
+    }
 
-        int offset = 0;
-        while (offset < BLOCK_SIZE) {
-            DirEntry *entry = (DirEntry *)(block + offset);
-            if (entry->inode_num == 0 || entry->name_len == 0) break;
-            printf("  - '%s' (inode %u)\n", entry->name, entry->inode_num);
-            offset += sizeof(uint32_t) + sizeof(uint8_t) + entry->name_len + 1;
+    // Step 8: If it's a directory, print its hash layout and entries
+    if (inode.type == TYPE_DIR) {
+        uint32_t buckets, entries;
+        dir_stats(&inode, &buckets, &entries);
+        if (inode.flags & INODE_HASHED) {
+            fprintf(out, "  Hash index: Block %u, %u buckets, %u entries\n", inode.direct[0], buckets, entries);
+        } else {
+            fprintf(out, "  Linear directory block: %u\n", inode.direct[0]);
         }
+
+        fprintf(out, "Directory Entries:\n");
+        dir_foreach(inode_num, print_entry, out);
     }
 }
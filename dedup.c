@@ -0,0 +1,351 @@
+// dedup.c
+// Block deduplication: a fingerprint -> block index and per-block reference
+// counts for data blocks shared between files. With EXFS2_DEDUP=1, add
+// fingerprints every block it writes and references an identical indexed
+// block instead of writing a new one; remove drops a reference and frees the
+// block only with the last one. The index lives in dedup.seg, saved at every
+// checkpoint and rebuilt from the inodes after an unclean shutdown. Once the
+// file exists it is loaded even when dedup is off, so shared blocks stay safe.
+
+#include "exfs2.h"
+#include <fcntl.h>
+
+#define DEDUP_FILE "dedup.seg"
+#define DEDUP_MAGIC 0x45584444                // "EXDD"
+#define DEDUP_MIN_ENTRIES 1024
+
+#define FP_PRIME1 2654435761u
+#define FP_PRIME2 2246822519u
+
+// Fingerprint state: 8 independent 32-bit lanes, one SIMD register with AVX2
+typedef uint32_t FingerprintLanes __attribute__((vector_size(32)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define FINGERPRINT_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define FINGERPRINT_CLONES
+#endif
+
+// On-disk header followed by `count` DedupRecords
+typedef struct {
+    uint32_t magic;                       // DEDUP_MAGIC
+    uint32_t count;                       // Number of records
+} DedupHeader;
+
+typedef struct {
+    uint64_t fingerprint;
+    uint32_t block;
+    uint32_t refs;
+} __attribute__((packed)) DedupRecord;
+
+typedef struct {
+    uint64_t fingerprint;
+    uint32_t block;
+    uint32_t refs;                        // Files referencing the block, 0 = unused entry
+    int fp_next;                          // Next entry in the fingerprint bucket (or the free list)
+    int block_next;                       // Next entry in the block bucket
+} DedupEntry;
+
+static DedupEntry *entries = NULL;
+static int capacity = 0;                  // Entries allocated, also the number of buckets
+static int live = 0;                      // Entries in use
+static int free_head = -1;
+static int *fp_buckets = NULL;
+static int *block_buckets = NULL;
+static int enabled = 0;
+static int persistent = 0;                // dedup.seg exists for this filesystem
+static int dirty = 0;
+
+/**
+ * Fingerprint one data block. Lanes are mixed independently so the loop runs
+ * as vector instructions; the AVX2 clone is chosen at load time when the CPU has it.
+ */
+FINGERPRINT_CLONES
+uint64_t block_fingerprint(const void *block) {
+    FingerprintLanes acc = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    acc *= FP_PRIME1;
+    const uint8_t *p = block;
+    for (size_t off = 0; off < BLOCK_SIZE; off += sizeof(FingerprintLanes)) {
+        FingerprintLanes v;
+        memcpy(&v, p + off, sizeof(v));
+        acc += v * FP_PRIME2;
+        acc = (acc << 13) | (acc >> 19);
+        acc *= FP_PRIME1;
+    }
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; ++i) h = (h ^ acc[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t fp_bucket(uint64_t fingerprint) {
+    return (uint32_t)(fingerprint >> 32 ^ fingerprint) & (capacity - 1);
+}
+
+static uint32_t block_bucket(uint32_t block) {
+    return (block * 2654435761u) & (capacity - 1);
+}
+
+static void link_entry(int e) {
+    entries[e].fp_next = fp_buckets[fp_bucket(entries[e].fingerprint)];
+    fp_buckets[fp_bucket(entries[e].fingerprint)] = e;
+    entries[e].block_next = block_buckets[block_bucket(entries[e].block)];
+    block_buckets[block_bucket(entries[e].block)] = e;
+}
+
+/**
+ * Double the entry table and rehash (the bucket count always equals the capacity).
+ */
+static void grow_table() {
+    int old = capacity;
+    capacity = capacity ? capacity * 2 : DEDUP_MIN_ENTRIES;
+    entries = realloc(entries, (size_t)capacity * sizeof(DedupEntry));
+    fp_buckets = realloc(fp_buckets, (size_t)capacity * sizeof(int));
+    block_buckets = realloc(block_buckets, (size_t)capacity * sizeof(int));
+    if (!entries || !fp_buckets || !block_buckets) {
+        fprintf(stderr, "[dedup] Out of memory for the fingerprint index\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int b = 0; b < capacity; ++b) fp_buckets[b] = block_buckets[b] = -1;
+    for (int e = 0; e < old; ++e) {
+        if (entries[e].refs) link_entry(e);
+    }
+    for (int e = capacity - 1; e >= old; --e) {
+        entries[e].refs = 0;
+        entries[e].fp_next = free_head;
+        free_head = e;
+    }
+}
+
+static int find_block(uint32_t block) {
+    if (!capacity) return -1;
+    for (int e = block_buckets[block_bucket(block)]; e >= 0; e = entries[e].block_next) {
+        if (entries[e].block == block) return e;
+    }
+    return -1;
+}
+
+static void insert_entry(uint64_t fingerprint, uint32_t block, uint32_t refs) {
+    if (free_head < 0) grow_table();
+    int e = free_head;
+    free_head = entries[e].fp_next;
+    entries[e].fingerprint = fingerprint;
+    entries[e].block = block;
+    entries[e].refs = refs;
+    link_entry(e);
+    live++;
+    dirty = 1;
+}
+
+static void remove_entry(int e) {
+    int *link = &fp_buckets[fp_bucket(entries[e].fingerprint)];
+    while (*link != e) link = &entries[*link].fp_next;
+    *link = entries[e].fp_next;
+    link = &block_buckets[block_bucket(entries[e].block)];
+    while (*link != e) link = &entries[*link].block_next;
+    *link = entries[e].block_next;
+
+    entries[e].refs = 0;
+    entries[e].fp_next = free_head;
+    free_head = e;
+    live--;
+    dirty = 1;
+}
+
+/**
+ * Return 1 if add should deduplicate the blocks it writes (EXFS2_DEDUP=1).
+ */
+int dedup_enabled() {
+    return enabled;
+}
+
+/**
+ * Find an indexed block with the same contents as `block` and take a
+ * reference to it. Candidates with a matching fingerprint are compared byte
+ * for byte. Returns the shared block number, or 0 if there is none.
+ */
+uint32_t dedup_share(uint64_t fingerprint, const void *block) {
+    if (!capacity) return 0;
+    uint8_t candidate[BLOCK_SIZE];
+    for (int e = fp_buckets[fp_bucket(fingerprint)]; e >= 0; e = entries[e].fp_next) {
+        if (entries[e].fingerprint != fingerprint) continue;
+        read_block(entries[e].block, candidate);
+        if (memcmp(candidate, block, BLOCK_SIZE) != 0) continue;
+        entries[e].refs++;
+        dirty = 1;
+        return entries[e].block;
+    }
+    return 0;
+}
+
+/**
+ * Index a newly written block so later writes can share it (one reference).
+ */
+void dedup_insert(uint64_t fingerprint, uint32_t block) {
+    insert_entry(fingerprint, block, 1);
+}
+
+/**
+ * Drop one reference to a data block. Returns the references left; when it
+ * is 0 the caller frees the block (blocks outside the index have one owner).
+ */
+uint32_t dedup_release(uint32_t block) {
+    int e = find_block(block);
+    if (e < 0) return 0;
+    dirty = 1;
+    if (--entries[e].refs > 0) return entries[e].refs;
+    remove_entry(e);
+    return 0;
+}
+
+/**
+ * Write the index to dedup.seg if it changed. Called at checkpoints, between transactions.
+ */
+void dedup_sync() {
+    if (!dirty || !persistent) return;
+    FILE *fp = fopen(DEDUP_FILE, "wb");
+    if (!fp) {
+        perror("[dedup] Failed to write fingerprint index");
+        return;
+    }
+    DedupHeader header = { DEDUP_MAGIC, (uint32_t)live };
+    fwrite(&header, sizeof(header), 1, fp);
+    for (int e = 0; e < capacity; ++e) {
+        if (!entries[e].refs) continue;
+        DedupRecord rec = { entries[e].fingerprint, entries[e].block, entries[e].refs };
+        fwrite(&rec, sizeof(rec), 1, fp);
+    }
+    fclose(fp);
+    dirty = 0;
+}
+
+/**
+ * Read dedup.seg into memory. Returns 1 if it was read, 0 if it does not
+ * exist and -1 if it is damaged (the records read so far are kept).
+ */
+static int load_index() {
+    FILE *fp = fopen(DEDUP_FILE, "rb");
+    if (!fp) return 0;
+
+    DedupHeader header = {0};
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == DEDUP_MAGIC;
+    DedupRecord rec;
+    for (uint32_t i = 0; ok && i < header.count; ++i) {
+        ok = fread(&rec, sizeof(rec), 1, fp) == 1;
+        if (ok && rec.refs) insert_entry(rec.fingerprint, rec.block, rec.refs);
+    }
+    fclose(fp);
+    if (!ok) fprintf(stderr, "[dedup] %s is damaged, recounting references\n", DEDUP_FILE);
+    return ok ? 1 : -1;
+}
+
+static void count_indirect(uint32_t block_num, int levels, uint32_t *refs, uint32_t total) {
+    if (block_num == 0 || block_num >= total) return;
+    uint32_t ptrs[PTRS_PER_BLOCK] = {0};
+    extract_block_list(block_num, ptrs, PTRS_PER_BLOCK);
+    for (size_t i = 0; i < PTRS_PER_BLOCK; ++i) {
+        if (ptrs[i] == 0) continue;   // Hole
+        if (levels > 1) count_indirect(ptrs[i], levels - 1, refs, total);
+        else if (ptrs[i] < total) refs[ptrs[i]]++;
+    }
+}
+
+/**
+ * Recount references from the file inodes after an unclean shutdown: the
+ * index on disk is as of the last checkpoint. Entries whose block no file
+ * uses are dropped; shared blocks missing from the index are fingerprinted again.
+ */
+static void rebuild_refs() {
+    uint32_t total = (uint32_t)num_data_segments * BLOCKS_PER_SEGMENT;
+    uint32_t *refs = calloc(total, sizeof(uint32_t));
+    if (!refs) {
+        fprintf(stderr, "[dedup] Out of memory recounting block references\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Inode inode;
+    uint32_t total_inodes = (uint32_t)num_inode_segments * inodes_per_segment;
+    for (uint32_t n = 0; n < total_inodes; ++n) {
+        read_inode(n, &inode);
+        if (inode.type != TYPE_FILE || (inode.flags & (INODE_INLINE | INODE_COMPRESSED))) continue;
+
+        if (inode.flags & INODE_EXTENTS) {
+            for (int e = 0; e < inode.extent_count; ++e) {
+                for (uint32_t b = 0; b < inode.extents[e].length; ++b) {
+                    if (inode.extents[e].start + b < total) refs[inode.extents[e].start + b]++;
+                }
+            }
+            continue;
+        }
+        for (int k = 0; k < DIRECT_BLOCKS; ++k) {
+            if (inode.direct[k] && inode.direct[k] < total) refs[inode.direct[k]]++;
+        }
+        count_indirect(inode.indirect_single, 1, refs, total);
+        count_indirect(inode.indirect_double, 2, refs, total);
+        count_indirect(inode.large.indirect_triple, 3, refs, total);
+    }
+
+    for (int e = 0; e < capacity; ++e) {
+        if (!entries[e].refs) continue;
+        uint32_t block = entries[e].block;
+        if (block < total && refs[block]) {
+            entries[e].refs = refs[block];
+            refs[block] = 0;   // Handled
+        } else {
+            remove_entry(e);
+        }
+    }
+
+    uint32_t shared = 0;
+    uint8_t data[BLOCK_SIZE];
+    for (uint32_t b = 0; b < total; ++b) {
+        if (refs[b] < 2) continue;
+        read_block(b, data);
+        insert_entry(block_fingerprint(data), b, refs[b]);
+        shared++;
+    }
+    free(refs);
+    dirty = 1;
+    fprintf(stderr, "[dedup] Recounted references: %d indexed blocks, %u re-indexed\n", live, shared);
+}
+
+/**
+ * Load the fingerprint index at mount, recounting references if the last
+ * unmount was `unclean`. With EXFS2_DEDUP=1 an empty index is created, so
+ * the filesystem is known to share blocks from then on.
+ */
+void dedup_load(int unclean) {
+    const char *env = getenv("EXFS2_DEDUP");
+    enabled = env && strcmp(env, "0") != 0;
+
+    int loaded = load_index();
+    persistent = loaded != 0;
+    if (!persistent && enabled) {
+        persistent = 1;
+        dirty = 1;
+        dedup_sync();
+        int fd = open(DEDUP_FILE, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    if (persistent && (unclean || loaded < 0)) rebuild_refs();
+}
+
+/**
+ * Print index statistics to stderr.
+ */
+void dedup_report() {
+    if (!persistent) return;
+    uint64_t extra = 0;
+    for (int e = 0; e < capacity; ++e) {
+        if (entries[e].refs > 1) extra += entries[e].refs - 1;
+    }
+    fprintf(stderr, "[dedup] %d indexed blocks, %llu shared references (%llu KB saved)\n",
+            live, (unsigned long long)extra, (unsigned long long)extra * BLOCK_SIZE / 1024);
+}
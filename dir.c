@@ -0,0 +1,535 @@
+// dir.c
+// Directory storage. A directory is an on-disk hash table: direct[0] holds a
+// DirIndex block whose bucket slots point to chains of DirBucket blocks, so
+// lookups and inserts only touch the bucket a name hashes to. The table
+// doubles to keep a few entries per bucket; past DIR_MAX_BUCKETS buckets each
+// index slot points to a second-level block of DIR_L2_SLOTS chain heads
+// instead, so a lookup reads at most three blocks. Bucket blocks that removes
+// empty are freed, and a block merges with the next one in its chain once
+// both fit in one. Directories from older images use a single linear block and
+// are converted to the hashed format the first time they are modified.
+
+#include "exfs2.h"
+
+#define DIR_INDEX_MAGIC 0x45584448             // "EXDH"
+#define DIR_MAX_BUCKETS ((BLOCK_SIZE - 4 * sizeof(uint32_t)) / sizeof(uint32_t))
+#define DIR_L2_SLOTS (BLOCK_SIZE / sizeof(uint32_t))   // Chain heads per second-level index block
+#define DIR_MAX_TWO_LEVEL (DIR_MAX_BUCKETS * DIR_L2_SLOTS)
+#define DIR_LOAD_FACTOR 16                     // Average entries per bucket before the table doubles
+#define DIR_BUCKET_BYTES (BLOCK_SIZE - 2 * sizeof(uint32_t))
+#define DIRENT_LEN(name_len) (sizeof(uint32_t) + sizeof(uint8_t) + (name_len) + 1)
+
+// Hash index block (directory inode's direct[0])
+typedef struct {
+    uint32_t magic;                       // DIR_INDEX_MAGIC
+    uint32_t bucket_count;                // Buckets in use (grows by doubling); two levels past DIR_MAX_BUCKETS
+    uint32_t entry_count;                 // Entries in the whole directory
+    uint32_t reserved;
+    uint32_t buckets[DIR_MAX_BUCKETS];    // First block of each bucket chain, or of each second-level block (0 = empty)
+} DirIndex;
+
+// Bucket block: packed entries in the same record format as DirEntry
+typedef struct {
+    uint32_t next;                        // Next block in this bucket's chain (0 = end)
+    uint32_t used;                        // Bytes of entries[] in use
+    uint8_t entries[DIR_BUCKET_BYTES];
+} DirBucket;
+
+// Entry collected while converting or rehashing a directory
+typedef struct {
+    uint32_t inode_num;
+    char name[MAX_NAME_LEN + 1];
+} DirRecord;
+
+typedef struct {
+    DirRecord *records;
+    size_t count;
+    size_t capacity;
+} DirRecordList;
+
+/**
+ * FNV-1a hash of a file name.
+ */
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int entry_matches(const DirEntry *entry, const char *name, size_t len) {
+    return entry->name_len == len && strncmp(entry->name, name, len) == 0;
+}
+
+/**
+ * Append an entry record at `dst`.
+ */
+static void pack_entry(uint8_t *dst, uint32_t inode_num, const char *name, size_t len) {
+    uint8_t name_len = (uint8_t)len;
+    memcpy(dst, &inode_num, sizeof(uint32_t));
+    memcpy(dst + sizeof(uint32_t), &name_len, sizeof(uint8_t));
+    memcpy(dst + sizeof(uint32_t) + sizeof(uint8_t), name, len);
+    dst[sizeof(uint32_t) + sizeof(uint8_t) + len] = '\0';
+}
+
+static int two_level(const DirIndex *index) {
+    return index->bucket_count > DIR_MAX_BUCKETS;
+}
+
+/**
+ * Copy the chain heads of up to DIR_L2_SLOTS buckets starting at `first` (a
+ * multiple of DIR_L2_SLOTS) into `heads`. Returns how many buckets it covers.
+ */
+static uint32_t load_heads(const DirIndex *index, uint32_t first, uint32_t *heads) {
+    uint32_t count = index->bucket_count - first < DIR_L2_SLOTS ? index->bucket_count - first : DIR_L2_SLOTS;
+    if (!two_level(index)) {
+        memcpy(heads, index->buckets + first, count * sizeof(uint32_t));
+    } else if (index->buckets[first / DIR_L2_SLOTS] != 0) {
+        read_block(index->buckets[first / DIR_L2_SLOTS], heads);
+    } else {
+        memset(heads, 0, count * sizeof(uint32_t));
+    }
+    return count;
+}
+
+/**
+ * Return the first block of bucket `b`'s chain (0 = empty).
+ */
+static uint32_t bucket_head(const DirIndex *index, uint32_t b) {
+    if (!two_level(index)) return index->buckets[b];
+    uint32_t l2 = index->buckets[b / DIR_L2_SLOTS];
+    if (l2 == 0) return 0;
+    uint32_t heads[DIR_L2_SLOTS];
+    read_block(l2, heads);
+    return heads[b % DIR_L2_SLOTS];
+}
+
+/**
+ * Point bucket `b` at the chain starting at `blk` (0 = empty). A second-level
+ * block is allocated for its first chain and freed with its last. Updates
+ * `index` in memory only.
+ */
+static void set_bucket_head(DirIndex *index, uint32_t b, uint32_t blk) {
+    if (!two_level(index)) {
+        index->buckets[b] = blk;
+        return;
+    }
+
+    uint32_t heads[DIR_L2_SLOTS];
+    uint32_t *l2 = &index->buckets[b / DIR_L2_SLOTS];
+    if (*l2 == 0) {
+        if (blk == 0) return;
+        *l2 = find_free_block();
+        memset(heads, 0, sizeof(heads));
+    } else {
+        read_block(*l2, heads);
+    }
+    heads[b % DIR_L2_SLOTS] = blk;
+
+    size_t used = 0;
+    while (used < DIR_L2_SLOTS && heads[used] == 0) used++;
+    if (used == DIR_L2_SLOTS) {   // No chains left under this block
+        mark_block_free(*l2);
+        *l2 = 0;
+        return;
+    }
+    write_block(*l2, heads);
+}
+
+/**
+ * Visit the entries of a linear (pre-hash) directory block.
+ */
+static int linear_foreach(uint32_t block_num, DirVisitor visit, void *ctx) {
+    char block[BLOCK_SIZE];
+    read_block(block_num, block);
+
+    size_t offset = 0;
+    while (offset + DIRENT_LEN(0) < BLOCK_SIZE) {
+        DirEntry *entry = (DirEntry *)(block + offset);
+        if (entry->inode_num == 0 || entry->name_len == 0) break;
+        if (visit(entry->inode_num, entry->name, ctx)) return 1;
+        offset += DIRENT_LEN(entry->name_len);
+    }
+    return 0;
+}
+
+/**
+ * Visit every entry of a hashed directory, bucket by bucket.
+ */
+static int hashed_foreach(const Inode *dir, DirVisitor visit, void *ctx) {
+    DirIndex index;
+    DirBucket bucket;
+    uint32_t heads[DIR_L2_SLOTS];
+    read_block(dir->direct[0], &index);
+
+    for (uint32_t first = 0; first < index.bucket_count; first += DIR_L2_SLOTS) {
+        uint32_t count = load_heads(&index, first, heads);
+        for (uint32_t b = 0; b < count; ++b) {
+            for (uint32_t blk = heads[b]; blk != 0; blk = bucket.next) {
+                read_block(blk, &bucket);
+                for (uint32_t off = 0; off < bucket.used;) {
+                    DirEntry *entry = (DirEntry *)(bucket.entries + off);
+                    if (visit(entry->inode_num, entry->name, ctx)) return 1;
+                    off += DIRENT_LEN(entry->name_len);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Call `visit` for each entry of a directory until it returns non-zero.
+ */
+void dir_foreach(uint32_t dir_inode_num, DirVisitor visit, void *ctx) {
+    Inode dir;
+    read_inode(dir_inode_num, &dir);
+    if (dir.type != TYPE_DIR) return;
+
+    if (dir.flags & INODE_HASHED) {
+        hashed_foreach(&dir, visit, ctx);
+    } else {
+        linear_foreach(dir.direct[0], visit, ctx);
+    }
+}
+
+static int collect_record(uint32_t inode_num, const char *name, void *ctx) {
+    DirRecordList *list = ctx;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->records = realloc(list->records, list->capacity * sizeof(DirRecord));
+        if (!list->records) {
+            fprintf(stderr, "[dir] Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->records[list->count].inode_num = inode_num;
+    strncpy(list->records[list->count].name, name, MAX_NAME_LEN);
+    list->records[list->count].name[MAX_NAME_LEN] = '\0';
+    list->count++;
+    return 0;
+}
+
+/**
+ * Add an entry to the bucket chain its name hashes to, chaining a new bucket
+ * block when every block in the chain is full. Updates `index` in memory only.
+ */
+static void bucket_add(DirIndex *index, uint32_t inode_num, const char *name, size_t len) {
+    uint32_t b = hash_name(name, len) % index->bucket_count;
+    size_t need = DIRENT_LEN(len);
+    DirBucket bucket;
+    uint32_t last = 0;
+
+    for (uint32_t blk = bucket_head(index, b); blk != 0; blk = bucket.next) {
+        read_block(blk, &bucket);
+        if (bucket.used + need <= DIR_BUCKET_BYTES) {
+            pack_entry(bucket.entries + bucket.used, inode_num, name, len);
+            bucket.used += need;
+            write_block(blk, &bucket);
+            return;
+        }
+        last = blk;
+    }
+
+    uint32_t new_blk = find_free_block();
+    memset(&bucket, 0, sizeof(bucket));
+    pack_entry(bucket.entries, inode_num, name, len);
+    bucket.used = need;
+    write_block(new_blk, &bucket);
+
+    if (last == 0) {
+        set_bucket_head(index, b, new_blk);
+    } else {
+        read_block(last, &bucket);
+        bucket.next = new_blk;
+        write_block(last, &bucket);
+    }
+}
+
+/**
+ * Release every bucket and second-level block of a hashed directory and
+ * empty its buckets.
+ */
+static void free_buckets(DirIndex *index) {
+    DirBucket bucket;
+    uint32_t heads[DIR_L2_SLOTS];
+    for (uint32_t first = 0; first < index->bucket_count; first += DIR_L2_SLOTS) {
+        uint32_t count = load_heads(index, first, heads);
+        for (uint32_t b = 0; b < count; ++b) {
+            for (uint32_t blk = heads[b]; blk != 0; blk = bucket.next) {
+                read_block(blk, &bucket);
+                mark_block_free(blk);
+            }
+        }
+    }
+    if (two_level(index)) {
+        for (uint32_t i = 0; i < DIR_MAX_BUCKETS; ++i) {
+            if (index->buckets[i]) mark_block_free(index->buckets[i]);
+        }
+    }
+    memset(index->buckets, 0, sizeof(index->buckets));
+}
+
+/**
+ * Redistribute all entries over `new_count` buckets.
+ */
+static void rehash_directory(const Inode *dir, DirIndex *index, uint32_t new_count) {
+    DirRecordList list = {0};
+    hashed_foreach(dir, collect_record, &list);
+
+    free_buckets(index);
+    index->bucket_count = new_count;
+    for (size_t i = 0; i < list.count; ++i) {
+        bucket_add(index, list.records[i].inode_num, list.records[i].name, strlen(list.records[i].name));
+    }
+    free(list.records);
+}
+
+/**
+ * Turn an inode into an empty hashed directory with a fresh index block.
+ * The caller writes the inode.
+ */
+void dir_create(Inode *dir) {
+    memset(dir, 0, sizeof(Inode));
+    dir->type = TYPE_DIR;
+    dir->flags = INODE_HASHED;
+    dir->direct[0] = find_free_block();
+
+    DirIndex index = {0};
+    index.magic = DIR_INDEX_MAGIC;
+    index.bucket_count = 1;
+    write_block(dir->direct[0], &index);
+}
+
+/**
+ * Convert a linear directory block into the hashed format.
+ */
+static void convert_linear_dir(uint32_t dir_inode_num, Inode *dir) {
+    DirRecordList list = {0};
+    uint32_t old_block = dir->direct[0];
+    linear_foreach(old_block, collect_record, &list);
+
+    Inode hashed;
+    dir_create(&hashed);
+    hashed.size = dir->size;
+
+    DirIndex index;
+    read_block(hashed.direct[0], &index);
+    for (size_t i = 0; i < list.count; ++i) {
+        bucket_add(&index, list.records[i].inode_num, list.records[i].name, strlen(list.records[i].name));
+    }
+    index.entry_count = list.count;
+    write_block(hashed.direct[0], &index);
+    free(list.records);
+
+    mark_block_free(old_block);   // Block 0 (the original root block) stays reserved
+    *dir = hashed;
+    write_inode(dir_inode_num, dir);
+    fprintf(stderr, "[dir] Converted directory inode %u to hashed format\n", dir_inode_num);
+}
+
+/**
+ * Search the directory blocks for `name`. Returns its inode number, or -1.
+ */
+static int lookup_on_disk(const Inode *dir, const char *name) {
+    size_t len = strlen(name);
+    if (dir->flags & INODE_HASHED) {
+        DirIndex index;
+        DirBucket bucket;
+        read_block(dir->direct[0], &index);
+
+        uint32_t b = hash_name(name, len) % index.bucket_count;
+        for (uint32_t blk = bucket_head(&index, b); blk != 0; blk = bucket.next) {
+            read_block(blk, &bucket);
+            for (uint32_t off = 0; off < bucket.used;) {
+                DirEntry *entry = (DirEntry *)(bucket.entries + off);
+                if (entry_matches(entry, name, len)) return entry->inode_num;
+                off += DIRENT_LEN(entry->name_len);
+            }
+        }
+        return -1;
+    }
+
+    char block[BLOCK_SIZE];
+    read_block(dir->direct[0], block);
+    size_t offset = 0;
+    while (offset + DIRENT_LEN(0) < BLOCK_SIZE) {
+        DirEntry *entry = (DirEntry *)(block + offset);
+        if (entry->inode_num == 0 || entry->name_len == 0) break;
+        if (entry_matches(entry, name, len)) return entry->inode_num;
+        offset += DIRENT_LEN(entry->name_len);
+    }
+    return -1;
+}
+
+/**
+ * Look up `name` in a directory through the dentry cache. Returns its inode
+ * number, or -1 if absent.
+ */
+int dir_lookup(uint32_t dir_inode_num, const char *name) {
+    int inode_num;
+    if (dcache_get(dir_inode_num, name, &inode_num)) return inode_num;
+
+    Inode dir;
+    read_inode(dir_inode_num, &dir);
+    if (dir.type != TYPE_DIR) return -1;
+
+    inode_num = lookup_on_disk(&dir, name);
+    dcache_put(dir_inode_num, name, inode_num);
+    return inode_num;
+}
+
+/**
+ * Add `name` -> `inode_num` to a directory. Returns 0 on success, -1 if the
+ * name is invalid or already present.
+ */
+int dir_insert(uint32_t dir_inode_num, const char *name, uint32_t inode_num) {
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_NAME_LEN) {
+        fprintf(stderr, "[dir] Invalid name length %zu for '%s'\n", len, name);
+        return -1;
+    }
+    if (dir_lookup(dir_inode_num, name) >= 0) {
+        fprintf(stderr, "[dir] '%s' already exists in directory inode %u\n", name, dir_inode_num);
+        return -1;
+    }
+
+    Inode dir;
+    read_inode(dir_inode_num, &dir);
+    if (!(dir.flags & INODE_HASHED)) convert_linear_dir(dir_inode_num, &dir);
+
+    DirIndex index;
+    read_block(dir.direct[0], &index);
+    bucket_add(&index, inode_num, name, len);
+    index.entry_count++;
+
+    // Keep buckets short: double the table once the average bucket holds more than a few entries
+    if (index.entry_count > (uint64_t)index.bucket_count * DIR_LOAD_FACTOR && index.bucket_count < DIR_MAX_TWO_LEVEL) {
+        uint32_t new_count = index.bucket_count * 2;
+        if (new_count > DIR_MAX_TWO_LEVEL) new_count = DIR_MAX_TWO_LEVEL;
+        rehash_directory(&dir, &index, new_count);
+    }
+
+    write_block(dir.direct[0], &index);
+    dcache_put(dir_inode_num, name, inode_num);
+    return 0;
+}
+
+/**
+ * Tidy bucket block `blk` of bucket `b` after an entry left it. An empty block
+ * is unlinked from its chain (`prev` is the block before it, 0 for the head)
+ * and freed; otherwise the next block is merged into it when both fit in one.
+ * Writes `bucket` back; updates `index` in memory only.
+ */
+static void compact_bucket(DirIndex *index, uint32_t b, uint32_t prev, uint32_t blk, DirBucket *bucket) {
+    if (bucket->used == 0) {
+        if (prev == 0) {
+            set_bucket_head(index, b, bucket->next);
+        } else {
+            DirBucket before;
+            read_block(prev, &before);
+            before.next = bucket->next;
+            write_block(prev, &before);
+        }
+        mark_block_free(blk);
+        return;
+    }
+
+    if (bucket->next != 0) {
+        DirBucket next;
+        uint32_t next_blk = bucket->next;
+        read_block(next_blk, &next);
+        if (bucket->used + next.used <= DIR_BUCKET_BYTES) {
+            memcpy(bucket->entries + bucket->used, next.entries, next.used);
+            bucket->used += next.used;
+            bucket->next = next.next;
+            mark_block_free(next_blk);
+        }
+    }
+    write_block(blk, bucket);
+}
+
+/**
+ * Remove `name` from a directory. Returns the inode number it referred to,
+ * or -1 if it was not found.
+ */
+int dir_remove(uint32_t dir_inode_num, const char *name) {
+    if (dir_lookup(dir_inode_num, name) < 0) return -1;
+
+    Inode dir;
+    read_inode(dir_inode_num, &dir);
+    if (!(dir.flags & INODE_HASHED)) convert_linear_dir(dir_inode_num, &dir);
+
+    DirIndex index;
+    DirBucket bucket;
+    read_block(dir.direct[0], &index);
+
+    size_t len = strlen(name);
+    uint32_t b = hash_name(name, len) % index.bucket_count;
+    uint32_t prev = 0;
+    for (uint32_t blk = bucket_head(&index, b); blk != 0; prev = blk, blk = bucket.next) {
+        read_block(blk, &bucket);
+        for (uint32_t off = 0; off < bucket.used;) {
+            DirEntry *entry = (DirEntry *)(bucket.entries + off);
+            size_t entry_len = DIRENT_LEN(entry->name_len);
+            if (entry_matches(entry, name, len)) {
+                uint32_t inode_num = entry->inode_num;
+                memmove(bucket.entries + off, bucket.entries + off + entry_len, bucket.used - off - entry_len);
+                bucket.used -= entry_len;
+                memset(bucket.entries + bucket.used, 0, entry_len);
+                compact_bucket(&index, b, prev, blk, &bucket);
+
+                index.entry_count--;
+                write_block(dir.direct[0], &index);
+                dcache_put(dir_inode_num, name, -1);
+                return inode_num;
+            }
+            off += entry_len;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Call `fn` for every block a directory occupies (index, second-level and
+ * bucket blocks, or the single block of a linear directory).
+ */
+void dir_for_each_block(const Inode *dir, void (*fn)(uint32_t block_num)) {
+    fn(dir->direct[0]);
+    if (!(dir->flags & INODE_HASHED)) return;
+
+    DirIndex index;
+    DirBucket bucket;
+    uint32_t heads[DIR_L2_SLOTS];
+    read_block(dir->direct[0], &index);
+    for (uint32_t first = 0; first < index.bucket_count; first += DIR_L2_SLOTS) {
+        uint32_t count = load_heads(&index, first, heads);
+        for (uint32_t b = 0; b < count; ++b) {
+            for (uint32_t blk = heads[b]; blk != 0; blk = bucket.next) {
+                read_block(blk, &bucket);
+                fn(blk);
+            }
+        }
+    }
+    if (two_level(&index)) {
+        for (uint32_t i = 0; i < DIR_MAX_BUCKETS; ++i) {
+            if (index.buckets[i]) fn(index.buckets[i]);
+        }
+    }
+}
+
+/**
+ * Report bucket and entry counts of a hashed directory (0 buckets if linear).
+ */
+void dir_stats(const Inode *dir, uint32_t *buckets, uint32_t *entries) {
+    *buckets = 0;
+    *entries = 0;
+    if (!(dir->flags & INODE_HASHED)) return;
+
+    DirIndex index;
+    read_block(dir->direct[0], &index);
+    *buckets = index.bucket_count;
+    *entries = index.entry_count;
+}
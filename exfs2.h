@@ -4,23 +4,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 
 #define BLOCK_SIZE 4096                       // Block size in bytes
 #define SEGMENT_SIZE (1024 * 1024)            // Segment size (1MB)
 #define MAX_NAME_LEN 255                      // Maximum filename length
-#define MAX_SEGMENTS 1024                     // Max number of segments supported
-#define INODES_PER_SEGMENT 256                // Number of inodes per inode segment
+#define MAX_SEGMENTS ((1 << 24) - 1)          // Max segments per kind: global block numbers stay 32-bit (~16TB)
+#define MAX_OPEN_SEGMENTS 64                  // Segment files kept open at once
+#define INODES_PER_SEGMENT 256                // Inodes per inode segment with block-sized inodes (legacy
+                                              // geometry: 256 * 4100 bytes, so these segments exceed SEGMENT_SIZE)
 #define BLOCKS_PER_SEGMENT 256                // Number of blocks per data segment
 #define DIRECT_BLOCKS 12                      // Number of direct blocks in inode
 #define MAX_PATH 1024                         // Maximum path string length
 #define MAX_PATH_DEPTH 64                     // Maximum depth of directory tree
 #define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t)) // Pointers per indirect block
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS + PTRS_PER_BLOCK * (1 + PTRS_PER_BLOCK * (1 + PTRS_PER_BLOCK)))
+                                              // Blocks reachable through triple indirect (~4TB)
+
+#define MAX_INLINE_EXTENTS 64               // Extents stored directly in the inode
 
 #define TYPE_FILE 1
 #define TYPE_DIR  2
 
+// Inode flags
+#define INODE_EXTENTS 0x0001                  // Data mapped through extents[] instead of block pointers
+#define INODE_INLINE  0x0002                  // Data stored in inline_data[] inside the inode
+#define INODE_HASHED  0x0004                  // Directory stored as a hash index (see dir.c)
+#define INODE_COMPRESSED 0x0008               // Data stored as compressed chunks listed in chunk tables (see compress.c)
+
 // Directory Entry structure (packed to avoid padding)
 typedef struct {
     uint32_t inode_num;           // Inode number this entry points to
@@ -28,6 +41,25 @@ typedef struct {
     char name[MAX_NAME_LEN + 1];  // Null-terminated filename
 } __attribute__((packed)) DirEntry;
 
+// Extent: a run of physically contiguous blocks within one data segment
+typedef struct {
+    uint32_t logical;             // First file block covered by this extent
+    uint32_t start;               // First global data block of the run
+    uint32_t length;              // Number of blocks in the run
+} __attribute__((packed)) Extent;
+
+// Compressed chunk: where one COMPRESS_CHUNK_SIZE piece of a file is stored.
+// Chunk table blocks hold CHUNKS_PER_TABLE of these; a zero start ends the table.
+typedef struct {
+    uint32_t start;               // First global data block of the stored run
+    uint32_t stored;              // Bytes stored, CHUNK_RAW set if not compressed
+} CompressedChunk;
+
+#define COMPRESS_CHUNK_BLOCKS 16              // File blocks per compressed chunk
+#define COMPRESS_CHUNK_SIZE (COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_RAW 0x80000000u
+#define CHUNKS_PER_TABLE (BLOCK_SIZE / sizeof(CompressedChunk))
+
 // Inode structure (fixed to one block in size)
 typedef struct {
     uint32_t size;                        // File size in bytes
@@ -35,42 +67,238 @@ typedef struct {
     uint32_t direct[DIRECT_BLOCKS];       // Direct data block pointers
     uint32_t indirect_single;             // Pointer to single indirect block
     uint32_t indirect_double;             // Pointer to double indirect block
-    char padding[BLOCK_SIZE - sizeof(uint32_t) * (DIRECT_BLOCKS + 2) - sizeof(uint16_t)];
+    uint16_t flags;                       // INODE_* flags
+    uint16_t extent_count;                // Number of valid entries in extents[]
+    union {
+        Extent extents[MAX_INLINE_EXTENTS];   // Extent map (when INODE_EXTENTS is set)
+        struct {
+            uint32_t indirect_triple;         // Pointer to triple indirect block
+            uint32_t size_high;               // Upper 32 bits of the file size
+        } __attribute__((packed)) large;      // Block-pointer files (neither flag set)
+        uint8_t inline_data[BLOCK_SIZE - sizeof(uint32_t) * (DIRECT_BLOCKS + 2) - sizeof(uint16_t) * 3];
+                                              // File contents (when INODE_INLINE is set)
+    };
 } __attribute__((packed)) Inode;
 
-// Global segment file pointers
-extern FILE *inode_segments[MAX_SEGMENTS];
-extern FILE *data_segments[MAX_SEGMENTS];
+// Block-layout images written by every earlier version use this inode stride
+_Static_assert(sizeof(Inode) == 4100, "block-layout inode must stay 4100 bytes");
+
+#define SUPERBLOCK_FILE "superblock.seg"
+#define SUPERBLOCK_MAGIC 0x45584653           // "EXFS"
+#define EXFS2_VERSION 2                       // 2: adds inode_size
+
+#define INODE_SIZE_BLOCK ((uint32_t)sizeof(Inode)) // Original one-block inode layout
+#define DEFAULT_INODE_SIZE 256                // Compact inode size for new filesystems
+
+// Superblock: filesystem geometry and segment manifest, read once at mount
+typedef struct {
+    uint32_t magic;                       // SUPERBLOCK_MAGIC
+    uint32_t version;                     // EXFS2_VERSION
+    uint32_t block_size;                  // BLOCK_SIZE the image was created with
+    uint32_t segment_size;                // SEGMENT_SIZE the image was created with
+    uint32_t num_inode_segments;          // Inode segment files 0..n-1
+    uint32_t num_data_segments;           // Data segment files 0..n-1
+    uint32_t free_blocks;                 // Free data blocks at last unmount
+    uint32_t free_inodes;                 // Free inodes at last unmount
+    uint32_t root_inode;                  // Inode number of the root directory
+    uint32_t clean;                       // 1 if the last unmount completed
+    uint32_t inode_size;                  // On-disk bytes per inode (version 2+)
+} Superblock;
+
+// Global superblock, segment counters and inode layout
+extern Superblock superblock;
 extern int num_inode_segments;
 extern int num_data_segments;
+extern uint32_t inode_size;
+extern uint32_t inodes_per_segment;
+extern size_t inode_segment_size;
+
+// Inode accessors (on-disk layout selected at init)
+int valid_inode_size(uint32_t size);
+void set_inode_layout(uint32_t size);
+int inode_extent_capacity();
+uint32_t inode_inline_capacity();
+uint64_t inode_file_size(const Inode *inode);
+void set_inode_file_size(Inode *inode, uint64_t size);
+void read_inode(uint32_t inode_num, Inode *inode);
+void write_inode(uint32_t inode_num, const Inode *inode);
+void clear_inode(uint32_t inode_num);
+
+// Inode and dentry caches (icache.c); a dentry of -1 caches a missing name
+int icache_get(uint32_t inode_num, Inode *out);
+void icache_put(uint32_t inode_num, const Inode *inode);
+int dcache_get(uint32_t parent, const char *name, int *inode_num);
+void dcache_put(uint32_t parent, const char *name, int inode_num);
+void dcache_forget_dir(uint32_t dir);
+void dcache_clear();
+
+// Segment I/O (opened lazily through a bounded cache; stdio or mmap engine)
+size_t segment_read(int is_data, int index, size_t offset, void *buf, size_t len);
+void segment_write(int is_data, int index, size_t offset, const void *buf, size_t len);
+const uint8_t *segment_ptr(int is_data, int index, size_t offset, size_t len);
+int segment_fd(int is_data, int index);
+const char *segment_io_engine();
+void segment_filename(int is_data, int index, char *out, size_t out_len);
+void flush_all_segments();
+void segment_mark_unsynced(int index);
+void sync_data_segments();
+void close_all_segments();
 
 // Core filesystem utilities
-void init_filesystem();
+void init_filesystem(uint32_t new_inode_size);
+void unmount_filesystem();
+void write_superblock();
 void create_new_inode_segment();
 void create_new_data_segment();
 int find_free_inode();
 int find_free_block();
-void get_segment_and_block_offset(int global_block_num, int *segment_idx, int *block_offset);
+int get_segment_and_block_offset(uint32_t global_block_num, int *segment_idx, int *block_offset);
 void get_segment_and_inode_offset(int global_inode_num, int *segment_idx, int *inode_offset);
 int find_or_create_path(const char *exfs_path);
 int find_inode_by_path(const char *exfs_path);
 const char* extract_path_tail(const char *exfs_path, char *parent_out);
 
+// Block and inode allocation bitmaps
+void load_bitmaps(int force_rebuild);
+void sync_bitmaps();
+uint32_t count_free_blocks();
+uint32_t count_free_inodes();
+void mark_block_used(uint32_t block_num);
+void mark_block_free(uint32_t block_num);
+int block_is_used(uint32_t block_num);
+void mark_inode_used(uint32_t inode_num);
+void mark_inode_free(uint32_t inode_num);
+uint32_t alloc_block_run(uint32_t want, uint32_t *got);
+uint32_t alloc_block_run_exact(uint32_t count);
+int reserve_data_segment();
+
+// Block deduplication (dedup.c): fingerprint index and shared-block reference counts
+uint64_t block_fingerprint(const void *block);
+void dedup_load(int unclean);
+void dedup_sync();
+int dedup_enabled();
+uint32_t dedup_share(uint64_t fingerprint, const void *block);
+void dedup_insert(uint64_t fingerprint, uint32_t block);
+uint32_t dedup_release(uint32_t block);
+void dedup_report();
+
+// Compression (compress.c): LZ codec and chunk tables. Visitors return non-zero to stop.
+typedef int (*ChunkVisitor)(const CompressedChunk *chunk, void *ctx);
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len);
+int compress_enabled();
+uint32_t chunk_blocks(const CompressedChunk *chunk);
+void compressed_foreach(const Inode *inode, ChunkVisitor visit, void *ctx);
+
+// Block checksums (checksum.c): CRC32C areas per data segment, verify-on-read and scrub
+typedef struct {
+    uint32_t block;
+    uint32_t crc;
+} ChecksumUpdate;
+uint32_t crc32c(const void *data, size_t len);
+const char *crc32c_engine();
+int checksum_verify_enabled();
+void checksum_record(uint32_t start, uint32_t count, const void *buf);
+void checksum_set(uint32_t block_num, uint32_t crc);
+void checksum_clear(uint32_t start, uint32_t count);
+ChecksumUpdate *checksum_take_pending(size_t *count);
+int checksum_verify(uint32_t start, uint32_t count, const void *buf);
+void checksum_load(int rebuild);
+void checksum_sync();
+uint64_t run_scrub();
+
+// Deferred reclamation (reclaim.c): freed blocks are punched out of their segment files at checkpoints
+void reclaim_defer(uint32_t block_num);
+void reclaim_pending();
+uint64_t run_trim();
+
+// Double-buffered host input for add (input.c)
+typedef struct InputStream InputStream;
+InputStream *input_open(FILE *src, size_t chunk);
+size_t input_next(InputStream *in, uint8_t **data);
+int input_failed(InputStream *in);
+void input_close(InputStream *in);
+
 // Command implementations
-void run_add(const char *exfs_path, const char *host_path);
-void run_extract(const char *exfs_path);
-void run_remove(const char *exfs_path);
-void run_list();
-void run_debug(const char *exfs_path);
+int run_add(const char *exfs_path, const char *host_path);
+int run_add_stream(const char *exfs_path, FILE *src);
+int run_extract(const char *exfs_path);
+int run_extract_range(const char *exfs_path, uint64_t offset, uint64_t length);
+int run_remove(const char *exfs_path);
+void run_list(FILE *out);
+void run_debug(const char *exfs_path, FILE *out);
+int run_bulk_add(const char *manifest_path);
+int run_script(const char *script_path);
+void run_server(const char *socket_path);
+int run_client(const char *socket_path, char **args, int count);
+void release_file_blocks(const Inode *inode);
 
 // Utility for recursive directory listing
-void print_directory_recursive(uint32_t inode_num, int depth, uint8_t *visited);
+void print_directory_recursive(uint32_t inode_num, int depth, uint8_t *visited, FILE *out);
+
+// Block buffer cache (bcache.c): LRU pool with write-back at bcache_flush()
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+    uint64_t evictions;
+} BlockCacheStats;
+
+int read_block(uint32_t block_num, void *buf);
+void write_block(uint32_t block_num, const void *buf);
+int read_block_run(uint32_t start, uint32_t count, void *buf);
+void write_block_run(uint32_t start, uint32_t count, const void *buf);
+const uint8_t *block_run_ptr(uint32_t start, uint32_t count);
+void bcache_write_back(uint32_t start, uint32_t count);
+void bcache_invalidate(uint32_t start, uint32_t count);
+void prefetch_block(uint32_t block_num);
+void bcache_flush();
+BlockCacheStats bcache_stats();
+void bcache_report();
+
+// Metadata journal (journal.c): transactions, group commit and crash replay
+int journal_open(int keep);
+void journal_close();
+int journal_active();
+void journal_begin();
+uint64_t journal_commit();
+void journal_sync(uint64_t seq);
+void journal_sync_committed();
+uint64_t journal_seq();
+int journal_durable(uint64_t seq, int force);
+int journal_capture(int is_data, uint32_t num, const void *buf);
+int journal_lookup(int is_data, uint32_t num, void *buf);
+void journal_log_bitmap(int is_data, uint32_t num, int used);
+void journal_apply();
+void journal_checkpoint();
+void journal_replay();
+
+// Extract output (output.c): merges adjacent blocks and copies them to stdout in the kernel
+void output_set_fd(int fd);
+void output_use_private_fds();
+void output_release();
+void output_data(const void *data, size_t len);
+void output_run(uint32_t start, uint32_t blocks, size_t bytes);
+void output_zeros(uint64_t len);
+void output_block(uint32_t block_num, uint32_t bytes);
+void output_flush();
+void output_abort();
+int output_report();
 
 // Block reading utilities
 void extract_block_list(uint32_t block_num, uint32_t *out_blocks, size_t max_blocks);
-void extract_indirect_block(uint32_t block_num, uint32_t *remaining);
+void extract_hole(uint64_t blocks, uint64_t *remaining);
+void extract_indirect_block(uint32_t block_num, uint64_t *remaining);
+void extract_extent(const Extent *extent, uint64_t *remaining);
 
-// Directory entry helper
-void update_directory_entry(uint32_t parent_inode_num, uint32_t new_inode_num, const char *filename);
+// Hashed directories (dir.c). Visitors return non-zero to stop iterating.
+typedef int (*DirVisitor)(uint32_t inode_num, const char *name, void *ctx);
+void dir_create(Inode *dir);
+int dir_lookup(uint32_t dir_inode_num, const char *name);
+int dir_insert(uint32_t dir_inode_num, const char *name, uint32_t inode_num);
+int dir_remove(uint32_t dir_inode_num, const char *name);
+void dir_foreach(uint32_t dir_inode_num, DirVisitor visit, void *ctx);
+void dir_for_each_block(const Inode *dir, void (*fn)(uint32_t block_num));
+void dir_stats(const Inode *dir, uint32_t *buckets, uint32_t *entries);
 
 #endif // EXFS2_H
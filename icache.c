@@ -0,0 +1,152 @@
+// icache.c
+// In-process inode and dentry caches. read_inode/write_inode keep the inode
+// cache coherent; dir.c keeps the (parent, name) -> inode cache coherent,
+// including negative entries for names known to be absent. Both caches are
+// guarded by cache_lock so server threads can share them.
+
+#include "exfs2.h"
+#include <pthread.h>
+
+#define ICACHE_SLOTS 256                  // Direct-mapped inode slots
+#define DCACHE_BUCKETS 1024               // Dentry hash buckets
+#define DCACHE_MAX_ENTRIES 8192           // Dentries kept before the cache is flushed
+
+typedef struct {
+    uint32_t inode_num;
+    int valid;
+    Inode inode;
+} CachedInode;
+
+typedef struct Dentry {
+    struct Dentry *next;
+    uint32_t parent;                      // Directory inode the name lives in
+    int inode_num;                        // Target inode, or -1 for a negative entry
+    char name[];
+} Dentry;
+
+static CachedInode *icache = NULL;
+static Dentry *dcache[DCACHE_BUCKETS];
+static int dcache_entries = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Copy a cached inode into `out`. Returns 1 on a hit.
+ */
+int icache_get(uint32_t inode_num, Inode *out) {
+    pthread_mutex_lock(&cache_lock);
+    CachedInode *slot = icache ? &icache[inode_num % ICACHE_SLOTS] : NULL;
+    int hit = slot && slot->valid && slot->inode_num == inode_num;
+    if (hit) memcpy(out, &slot->inode, sizeof(Inode));
+    pthread_mutex_unlock(&cache_lock);
+    return hit;
+}
+
+/**
+ * Remember the current contents of an inode.
+ */
+void icache_put(uint32_t inode_num, const Inode *inode) {
+    pthread_mutex_lock(&cache_lock);
+    if (!icache) icache = calloc(ICACHE_SLOTS, sizeof(CachedInode));
+    if (icache) {
+        CachedInode *slot = &icache[inode_num % ICACHE_SLOTS];
+        slot->inode_num = inode_num;
+        slot->valid = 1;
+        memcpy(&slot->inode, inode, sizeof(Inode));
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static uint32_t dentry_hash(uint32_t parent, const char *name) {
+    uint32_t hash = 2166136261u ^ parent;
+    for (; *name; ++name) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash % DCACHE_BUCKETS;
+}
+
+static Dentry *dentry_find(uint32_t parent, const char *name) {
+    for (Dentry *d = dcache[dentry_hash(parent, name)]; d; d = d->next) {
+        if (d->parent == parent && strcmp(d->name, name) == 0) return d;
+    }
+    return NULL;
+}
+
+static void clear_dentries() {
+    for (int b = 0; b < DCACHE_BUCKETS; ++b) {
+        while (dcache[b]) {
+            Dentry *next = dcache[b]->next;
+            free(dcache[b]);
+            dcache[b] = next;
+        }
+    }
+    dcache_entries = 0;
+}
+
+/**
+ * Drop every cached dentry.
+ */
+void dcache_clear() {
+    pthread_mutex_lock(&cache_lock);
+    clear_dentries();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Look up a cached name. Returns 1 on a hit and stores the inode number
+ * (-1 if the name is known not to exist) in `inode_num`.
+ */
+int dcache_get(uint32_t parent, const char *name, int *inode_num) {
+    pthread_mutex_lock(&cache_lock);
+    Dentry *d = dentry_find(parent, name);
+    if (d) *inode_num = d->inode_num;
+    pthread_mutex_unlock(&cache_lock);
+    return d != NULL;
+}
+
+/**
+ * Record that `name` in `parent` refers to `inode_num` (-1 for absent).
+ */
+void dcache_put(uint32_t parent, const char *name, int inode_num) {
+    pthread_mutex_lock(&cache_lock);
+    Dentry *d = dentry_find(parent, name);
+    if (d) {
+        d->inode_num = inode_num;
+    } else {
+        if (dcache_entries >= DCACHE_MAX_ENTRIES) clear_dentries();
+        size_t len = strlen(name);
+        d = malloc(sizeof(Dentry) + len + 1);
+        if (d) {
+            d->parent = parent;
+            d->inode_num = inode_num;
+            memcpy(d->name, name, len + 1);
+
+            uint32_t b = dentry_hash(parent, name);
+            d->next = dcache[b];
+            dcache[b] = d;
+            dcache_entries++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Forget every dentry cached for names inside directory `dir`.
+ */
+void dcache_forget_dir(uint32_t dir) {
+    pthread_mutex_lock(&cache_lock);
+    for (int b = 0; b < DCACHE_BUCKETS; ++b) {
+        Dentry **link = &dcache[b];
+        while (*link) {
+            Dentry *d = *link;
+            if (d->parent == dir) {
+                *link = d->next;
+                free(d);
+                dcache_entries--;
+            } else {
+                link = &d->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -1,106 +1,195 @@
 #include "exfs2.h"
 
-// Global segment file pointers and counters
-FILE *inode_segments[MAX_SEGMENTS];
-FILE *data_segments[MAX_SEGMENTS];
+// Global segment counters and superblock
 int num_inode_segments = 0;
 int num_data_segments = 0;
+Superblock superblock;
 
 /**
- * Initialize the filesystem by opening or creating all existing segment files.
- * Sets up the root inode if needed.
+ * Write the in-memory superblock to disk.
  */
-void init_filesystem() {
-    // Load all existing inode segments
-    for (int i = 0; i < MAX_SEGMENTS; ++i) {
-        char filename[64];
-        snprintf(filename, sizeof(filename), "inode_segment_%d.seg", i);
-        FILE *fp = fopen(filename, "r+b");
-        if (!fp) break;
+void write_superblock() {
+    superblock.num_inode_segments = num_inode_segments;
+    superblock.num_data_segments = num_data_segments;
 
-        inode_segments[i] = fp;
-        num_inode_segments++;
+    FILE *fp = fopen(SUPERBLOCK_FILE, "wb");
+    if (!fp) {
+        perror("[init] Failed to write superblock");
+        exit(EXIT_FAILURE);
     }
+    fwrite(&superblock, sizeof(Superblock), 1, fp);
+    fclose(fp);
+}
 
-    // If no inode segments found, create segment 0
-    if (num_inode_segments == 0) {
-        char filename[] = "inode_segment_0.seg";
-        inode_segments[0] = fopen(filename, "w+b");
-        ftruncate(fileno(inode_segments[0]), SEGMENT_SIZE);
-        fprintf(stderr, "[init] Created inode segment: %s\n", filename);
-        num_inode_segments = 1;
+/**
+ * Read the superblock. Returns 1 if a valid superblock was found.
+ * Version 1 superblocks predate inode_size and always use block-sized inodes.
+ */
+static int read_superblock() {
+    FILE *fp = fopen(SUPERBLOCK_FILE, "rb");
+    if (!fp) return 0;
+
+    memset(&superblock, 0, sizeof(Superblock));
+    size_t bytes = fread(&superblock, 1, sizeof(Superblock), fp);
+    fclose(fp);
+    if (bytes < offsetof(Superblock, inode_size) || superblock.magic != SUPERBLOCK_MAGIC) return 0;
+
+    if (superblock.version == 1) {
+        superblock.inode_size = INODE_SIZE_BLOCK;
+        superblock.version = EXFS2_VERSION;
     }
 
-    // Load all existing data segments
+    if (superblock.version != EXFS2_VERSION || superblock.block_size != BLOCK_SIZE ||
+        superblock.segment_size != SEGMENT_SIZE || !valid_inode_size(superblock.inode_size)) {
+        fprintf(stderr, "[init] Unsupported filesystem (version %u, block size %u, segment size %u, inode size %u)\n",
+                superblock.version, superblock.block_size, superblock.segment_size, superblock.inode_size);
+        exit(EXIT_FAILURE);
+    }
+
+    set_inode_layout(superblock.inode_size);
+    num_inode_segments = superblock.num_inode_segments;
+    num_data_segments = superblock.num_data_segments;
+    return 1;
+}
+
+/**
+ * Count segment files by probing names in order. Only used for images
+ * created before the superblock existed.
+ */
+static int probe_segments(int is_data) {
+    int count = 0;
     for (int i = 0; i < MAX_SEGMENTS; ++i) {
         char filename[64];
-        snprintf(filename, sizeof(filename), "data_segment_%d.seg", i);
-        FILE *fp = fopen(filename, "r+b");
-        if (!fp) break;
-
-        data_segments[i] = fp;
-        num_data_segments++;
+        segment_filename(is_data, i, filename, sizeof(filename));
+        if (access(filename, F_OK) != 0) break;
+        count++;
     }
+    return count;
+}
 
-    // If no data segments found, create segment 0
-    if (num_data_segments == 0) {
-        char filename[] = "data_segment_0.seg";
-        data_segments[0] = fopen(filename, "w+b");
-        ftruncate(fileno(data_segments[0]), SEGMENT_SIZE);
-        fprintf(stderr, "[init] Created data segment: %s\n", filename);
+/**
+ * Checkpoint the journal, write back cached blocks and allocation state, mark
+ * the filesystem clean and close all segments. Registered with atexit() by
+ * init_filesystem(). Exiting in the middle of a transaction leaves the
+ * filesystem unclean: the transactions committed before it are made durable
+ * and the next mount replays them.
+ */
+void unmount_filesystem() {
+    if (journal_active()) {
+        fprintf(stderr, "[init] Operation aborted, the journal will recover the filesystem at the next mount\n");
+        journal_sync_committed();
+        close_all_segments();
+        return;
+    }
+    superblock.free_blocks = count_free_blocks();
+    superblock.free_inodes = count_free_inodes();
+    journal_checkpoint();
+    if (getenv("EXFS2_CACHE_STATS")) {
+        bcache_report();
+        dedup_report();
+    }
+    journal_close();
+    superblock.clean = 1;
+    write_superblock();
+    close_all_segments();
+}
 
-        // Zero out root directory block
-        char zero[BLOCK_SIZE] = {0};
-        fseek(data_segments[0], 0, SEEK_SET);
-        fwrite(zero, BLOCK_SIZE, 1, data_segments[0]);
-        fflush(data_segments[0]);
+/**
+ * Initialize the filesystem from its superblock, creating a new filesystem
+ * with `new_inode_size`-byte inodes if none exists. Segment files are opened
+ * lazily on first access. Sets up the root inode if needed.
+ */
+void init_filesystem(uint32_t new_inode_size) {
+    int mounted = read_superblock();
+
+    if (!mounted) {
+        // No superblock: adopt segments from an older image or create a new filesystem
+        num_inode_segments = probe_segments(0);
+        num_data_segments = probe_segments(1);
+
+        // Images from before the superblock always use block-sized inodes
+        set_inode_layout(num_inode_segments > 0 ? INODE_SIZE_BLOCK : new_inode_size);
+
+        memset(&superblock, 0, sizeof(Superblock));
+        superblock.magic = SUPERBLOCK_MAGIC;
+        superblock.version = EXFS2_VERSION;
+        superblock.block_size = BLOCK_SIZE;
+        superblock.segment_size = SEGMENT_SIZE;
+        superblock.root_inode = 0;
+        superblock.inode_size = inode_size;
+        superblock.clean = 1;
+
+        // If no inode segments found, create segment 0
+        if (num_inode_segments == 0) {
+            create_new_inode_segment();
+        }
+
+        // If no data segments found, create segment 0 with a zeroed root directory block
+        if (num_data_segments == 0) {
+            create_new_data_segment();
+        }
+        fprintf(stderr, "[init] Created superblock: %s (%u-byte inodes)\n", SUPERBLOCK_FILE, inode_size);
+    }
 
-        num_data_segments = 1;
+    // Bitmaps on disk are as of the last checkpoint: replay the journal on top
+    // of them after an unclean shutdown, or rebuild them if there is no journal
+    int unclean = !superblock.clean;
+    int journaled = journal_open(unclean);
+    if (unclean) {
+        fprintf(stderr, "[init] Filesystem was not unmounted cleanly\n");
     }
+    load_bitmaps(unclean && !journaled);
+    checksum_load(unclean && !journaled);
+    if (unclean && journaled) journal_replay();
+    dedup_load(unclean);
 
     // Set up root inode if not already initialized
-    fseek(inode_segments[0], 0, SEEK_SET);
     Inode root;
-    fread(&root, sizeof(Inode), 1, inode_segments[0]);
+    read_inode(0, &root);
     if (root.type != TYPE_DIR) {
         memset(&root, 0, sizeof(Inode));
         root.type = TYPE_DIR;
         root.direct[0] = 0;  // Root directory uses block 0
-        fseek(inode_segments[0], 0, SEEK_SET);
-        fwrite(&root, sizeof(Inode), 1, inode_segments[0]);
-        fflush(inode_segments[0]);
+        write_inode(0, &root);
         fprintf(stderr, "[init] Created root inode (inode 0)\n");
     }
 
+    superblock.clean = 0;
+    write_superblock();
+    atexit(unmount_filesystem);
+
     fprintf(stderr, "[init] Filesystem initialized with %d inode segments and %d data segments.\n",
             num_inode_segments, num_data_segments);
 }
 
 /**
- * Create a new inode segment file and add it to the inode_segments array.
+ * Create a new inode segment file and account for it in the superblock.
  */
 void create_new_inode_segment() {
-    if (num_inode_segments >= MAX_SEGMENTS) {
+    // Inode numbers are signed 32-bit in the path and directory code
+    if (num_inode_segments >= MAX_SEGMENTS || (int64_t)(num_inode_segments + 1) * inodes_per_segment > INT32_MAX) {
         fprintf(stderr, "[fatal] Maximum number of inode segments reached!\n");
         exit(1);
     }
 
     char filename[64];
-    snprintf(filename, sizeof(filename), "inode_segment_%d.seg", num_inode_segments);
+    segment_filename(0, num_inode_segments, filename, sizeof(filename));
     FILE *fp = fopen(filename, "w+b");
     if (!fp) {
         perror("[error] Failed to create new inode segment");
         exit(1);
     }
 
-    ftruncate(fileno(fp), SEGMENT_SIZE);
-    inode_segments[num_inode_segments] = fp;
+    ftruncate(fileno(fp), inode_segment_size);
+    fclose(fp);
     fprintf(stderr, "[init] Created new inode segment: %s\n", filename);
     num_inode_segments++;
 }
 
 /**
- * Create a new data segment file and add it to the data_segments array.
+ * Create a new data segment file and account for it in the superblock.
+ * Segments start out zero-filled, which also gives the root directory an
+ * empty block 0 in segment 0.
  */
 void create_new_data_segment() {
     if (num_data_segments >= MAX_SEGMENTS) {
@@ -109,7 +198,7 @@ void create_new_data_segment() {
     }
 
     char filename[64];
-    snprintf(filename, sizeof(filename), "data_segment_%d.seg", num_data_segments);
+    segment_filename(1, num_data_segments, filename, sizeof(filename));
     FILE *fp = fopen(filename, "w+b");
     if (!fp) {
         perror("[error] Failed to create new data segment");
@@ -117,7 +206,7 @@ void create_new_data_segment() {
     }
 
     ftruncate(fileno(fp), SEGMENT_SIZE);
-    data_segments[num_data_segments] = fp;
+    fclose(fp);
     fprintf(stderr, "[init] Created new data segment: %s\n", filename);
     num_data_segments++;
 }
@@ -126,8 +215,8 @@ void create_new_data_segment() {
  * Maps a global inode number to a segment index and inode index within the segment.
  */
 void get_segment_and_inode_offset(int global_inode_num, int *segment_idx, int *inode_offset) {
-    *segment_idx = global_inode_num / INODES_PER_SEGMENT;
-    *inode_offset = global_inode_num % INODES_PER_SEGMENT;
+    *segment_idx = global_inode_num / inodes_per_segment;
+    *inode_offset = global_inode_num % inodes_per_segment;
 
     if (*segment_idx >= num_inode_segments) {
         fprintf(stderr, "[helpers] Invalid inode segment index %d for inode %d\n",
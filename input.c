@@ -0,0 +1,145 @@
+// input.c
+// Double-buffered host input for add. A reader thread fills one chunk
+// buffer while the caller writes the previous chunk into the filesystem, so
+// reading the source (a file, a pipe or stdin) overlaps with segment writes.
+// Memory use is two chunks regardless of the input length. A read error ends
+// the stream like end of input does; input_failed() tells the two apart.
+
+#include "exfs2.h"
+#include <pthread.h>
+
+struct InputStream {
+    FILE *src;
+    size_t chunk;                         // Bytes per buffer
+    uint8_t *buf[2];
+    size_t len[2];                        // Bytes read into each buffer
+    int full[2];                          // Buffer filled and not yet released by the caller
+    int next_fill;                        // Buffer the reader fills next
+    int next_take;                        // Buffer the caller takes next
+    int held;                             // Buffer currently held by the caller (-1 = none)
+    int finished;                         // Caller has seen the last (short) chunk
+    int stop;                             // Ask the reader to exit early
+    int error;                            // The input stopped on a read error, not at its end
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/**
+ * Reader thread: fill buffers in turn until a short read marks end of input
+ * or a read error.
+ */
+static void *input_reader(void *arg) {
+    InputStream *in = arg;
+    for (;;) {
+        pthread_mutex_lock(&in->lock);
+        while (in->full[in->next_fill] && !in->stop) pthread_cond_wait(&in->changed, &in->lock);
+        int slot = in->next_fill;
+        int stop = in->stop;
+        pthread_mutex_unlock(&in->lock);
+        if (stop) break;
+
+        size_t n = 0;
+        int error = 0;
+        while (n < in->chunk) {
+            size_t got = fread(in->buf[slot] + n, 1, in->chunk - n, in->src);
+            if (got == 0) {
+                error = ferror(in->src);
+                if (error) perror("[input] Read failed");
+                break;
+            }
+            n += got;
+        }
+
+        pthread_mutex_lock(&in->lock);
+        in->error = error;
+        in->len[slot] = n;
+        in->full[slot] = 1;
+        in->next_fill = slot ^ 1;
+        pthread_cond_broadcast(&in->changed);
+        pthread_mutex_unlock(&in->lock);
+        if (n < in->chunk) break;   // End of input (or read error)
+    }
+    return NULL;
+}
+
+/**
+ * Start reading `src` in `chunk`-byte pieces (chunk should be a multiple of BLOCK_SIZE).
+ */
+InputStream *input_open(FILE *src, size_t chunk) {
+    InputStream *in = calloc(1, sizeof(InputStream));
+    if (!in) return NULL;
+    in->src = src;
+    in->chunk = chunk;
+    in->held = -1;
+    in->buf[0] = malloc(chunk);
+    in->buf[1] = malloc(chunk);
+    if (!in->buf[0] || !in->buf[1]) {
+        free(in->buf[0]);
+        free(in->buf[1]);
+        free(in);
+        return NULL;
+    }
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->changed, NULL);
+    pthread_create(&in->thread, NULL, input_reader, in);
+    return in;
+}
+
+/**
+ * Release the previous chunk and wait for the next one. Returns its length
+ * (less than the chunk size only for the last chunk, 0 at end of input) and
+ * points `data` at a chunk-sized buffer the caller may modify until the next call.
+ */
+size_t input_next(InputStream *in, uint8_t **data) {
+    pthread_mutex_lock(&in->lock);
+    if (in->held >= 0) {
+        in->full[in->held] = 0;
+        in->held = -1;
+        pthread_cond_broadcast(&in->changed);
+    }
+    if (in->finished) {
+        pthread_mutex_unlock(&in->lock);
+        return 0;
+    }
+
+    int slot = in->next_take;
+    while (!in->full[slot]) pthread_cond_wait(&in->changed, &in->lock);
+    in->held = slot;
+    in->next_take = slot ^ 1;
+    size_t len = in->len[slot];
+    if (len < in->chunk) in->finished = 1;
+    pthread_mutex_unlock(&in->lock);
+
+    *data = in->buf[slot];
+    return len;
+}
+
+/**
+ * Return 1 if the input ended on a read error (a truncated stream), not at
+ * its end. Valid once input_next() has returned the last chunk.
+ */
+int input_failed(InputStream *in) {
+    pthread_mutex_lock(&in->lock);
+    int error = in->error;
+    pthread_mutex_unlock(&in->lock);
+    return error;
+}
+
+/**
+ * Stop the reader and free the stream. Does not close the source file.
+ */
+void input_close(InputStream *in) {
+    pthread_mutex_lock(&in->lock);
+    in->stop = 1;
+    in->full[0] = in->full[1] = 0;
+    pthread_cond_broadcast(&in->changed);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->thread, NULL);
+
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->changed);
+    free(in->buf[0]);
+    free(in->buf[1]);
+    free(in);
+}
@@ -0,0 +1,595 @@
+// journal.c
+// Write-ahead metadata journal (journal.seg). Every operation that changes
+// metadata runs as a transaction between journal_begin() and journal_commit().
+// While one is open, inode writes, metadata block writes (write_block) and
+// bitmap changes are captured in memory instead of reaching their home
+// locations. Commit appends one record per transaction. A record holds a
+// header with a checksum, the transaction's bitmap changes in order, the
+// checksums of the blocks written since the previous record, and the latest
+// image of every inode and block it wrote.
+//
+// Commit only queues the record in memory. Records are made durable by
+// journal_sync(), which first forces the data segments written so far to disk
+// and then appends every queued record with one fdatasync, so a record never
+// reaches the disk before the file data it refers to. Concurrent callers share
+// that sync (group commit). Captured images go to their home locations only at a
+// checkpoint, once the journal is durable. A checkpoint writes the images
+// home, punches freed blocks out of the segment files, syncs the filesystem
+// and empties the journal. Until then, reads find
+// the images here.
+//
+// After an unclean shutdown, journal_replay() re-applies every complete
+// record on top of the bitmaps saved at the last checkpoint, so no full
+// scan is needed. File data is not journaled, only its block checksums.
+
+#define _GNU_SOURCE
+#include "exfs2.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define JOURNAL_FILE "journal.seg"
+#define JOURNAL_MAGIC 0x45584a54              // "EXJT"
+#define JOURNAL_HASH 4096                     // Image hash buckets, power of two
+#define JOURNAL_GROUP_COMMITS 32              // Commits allowed between syncs without a caller asking
+#define JOURNAL_CHECKPOINT_BYTES (16u << 20)  // Journal size that triggers a checkpoint
+
+enum { J_INODE = 1, J_BLOCK, J_BLOCK_USED, J_BLOCK_FREE, J_INODE_USED, J_INODE_FREE, J_CHECKSUM };
+
+// On-disk transaction header, followed by `length` bytes of entries
+typedef struct {
+    uint32_t magic;                       // JOURNAL_MAGIC
+    uint32_t checksum;                    // FNV-1a of the entries
+    uint64_t seq;                         // Transaction number
+    uint32_t length;                      // Entry bytes that follow
+    uint32_t inode_segments;              // Segment counts when the transaction committed
+    uint32_t data_segments;
+    uint32_t reserved;
+} JournalHeader;
+
+// On-disk entry: an image (followed by its bytes), a run of bitmap changes or
+// a run of block checksums (followed by one uint32_t per block)
+typedef struct {
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t num;                         // Inode or block number (first of the run)
+    uint32_t count;                       // Image bytes, or run length for bitmap and checksum entries
+} JournalEntry;
+
+// Captured inode or block image, newest contents
+typedef struct Image {
+    struct Image *next;                   // Hash chain
+    int is_data;                          // 1 = data block, 0 = inode
+    int dead;                             // Block was freed, do not write it home
+    uint32_t num;
+    uint64_t txn;                         // Last transaction that wrote it
+    uint8_t data[];
+} Image;
+
+static int journal_fd = -1;
+static int depth = 0;                     // journal_begin() nesting
+static uint64_t txn_seq = 0;              // Open (or last) transaction
+static off_t journal_bytes = 0;
+
+static Image *images[JOURNAL_HASH];
+static Image **txn_images = NULL;         // Images written by the open transaction
+static size_t txn_image_count = 0, txn_image_capacity = 0;
+static JournalEntry *txn_bitmap = NULL;   // Bitmap runs of the open transaction, in order
+static size_t txn_bitmap_count = 0, txn_bitmap_capacity = 0;
+
+// Group commit state, shared with server threads waiting for durability
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static uint64_t committed_seq = 0, synced_seq = 0;
+static int sync_running = 0;
+static int commits_since_sync = 0;
+static uint8_t *queued = NULL;            // Committed records not written to the journal yet
+static size_t queued_len = 0, queued_capacity = 0;
+static uint64_t sync_count = 0, commit_count = 0;
+
+static uint32_t checksum(const uint8_t *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t image_size(int is_data) {
+    return is_data ? BLOCK_SIZE : inode_size;
+}
+
+/**
+ * Bytes that follow an entry in a record.
+ */
+static size_t entry_payload(const JournalEntry *e) {
+    if (e->type == J_INODE || e->type == J_BLOCK) return e->count;
+    if (e->type == J_CHECKSUM) return (size_t)e->count * sizeof(uint32_t);
+    return 0;
+}
+
+/**
+ * Count the bytes `count` checksum updates take as runs of consecutive blocks.
+ */
+static size_t checksum_payload(const ChecksumUpdate *updates, size_t count) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (i == 0 || updates[i].block != updates[i - 1].block + 1) bytes += sizeof(JournalEntry);
+        bytes += sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+static Image **image_link(int is_data, uint32_t num) {
+    Image **link = &images[(num * 2654435761u + is_data) & (JOURNAL_HASH - 1)];
+    while (*link && ((*link)->num != num || (*link)->is_data != is_data)) link = &(*link)->next;
+    return link;
+}
+
+static void *grow(void *array, size_t *capacity, size_t item) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(array, *capacity * item);
+    if (!grown) {
+        fprintf(stderr, "[journal] Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return grown;
+}
+
+/**
+ * Open (creating if needed) the journal. Unless `keep` is set, leftover
+ * records are discarded. Returns 1 if the journal file already existed.
+ */
+int journal_open(int keep) {
+    int existed = access(JOURNAL_FILE, F_OK) == 0;
+    journal_fd = open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0) {
+        perror("[journal] Failed to open journal");
+        exit(EXIT_FAILURE);
+    }
+    if (!keep && ftruncate(journal_fd, 0) != 0) perror("[journal] Failed to reset journal");
+    journal_bytes = lseek(journal_fd, 0, SEEK_END);
+    return existed;
+}
+
+/**
+ * Return 1 while a transaction is open.
+ */
+int journal_active() {
+    return depth > 0;
+}
+
+/**
+ * Start a transaction (nested calls join the open one). Checkpoints first
+ * when the journal has grown past its limit.
+ */
+void journal_begin() {
+    if (journal_fd < 0) return;
+    if (depth++ > 0) return;
+    if (journal_bytes >= JOURNAL_CHECKPOINT_BYTES) journal_checkpoint();
+    txn_seq++;
+}
+
+/**
+ * Capture an inode (is_data = 0) or metadata block (is_data = 1) write in the
+ * open transaction. Returns 0 when no transaction is open and the caller
+ * must write it home itself.
+ */
+int journal_capture(int is_data, uint32_t num, const void *buf) {
+    Image **link = image_link(is_data, num);
+    Image *img = *link;
+    if (depth == 0) {
+        if (img) {   // The home write replaces the captured image
+            *link = img->next;
+            free(img);
+        }
+        return 0;
+    }
+
+    if (!img) {
+        img = malloc(sizeof(Image) + image_size(is_data));
+        if (!img) {
+            fprintf(stderr, "[journal] Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        img->next = NULL;
+        img->is_data = is_data;
+        img->num = num;
+        img->txn = 0;
+        *link = img;
+    }
+    img->dead = 0;
+    memcpy(img->data, buf, image_size(is_data));
+
+    if (img->txn != txn_seq) {
+        img->txn = txn_seq;
+        if (txn_image_count == txn_image_capacity) txn_images = grow(txn_images, &txn_image_capacity, sizeof(Image *));
+        txn_images[txn_image_count++] = img;
+    }
+    return 1;
+}
+
+/**
+ * Copy the captured image of an inode or block into `buf`. Returns 0 if
+ * there is none and the home location is current.
+ */
+int journal_lookup(int is_data, uint32_t num, void *buf) {
+    Image *img = *image_link(is_data, num);
+    if (!img) return 0;
+    memcpy(buf, img->data, image_size(is_data));
+    return 1;
+}
+
+/**
+ * Record a bitmap change in the open transaction. A freed block also
+ * loses its captured image: it must not overwrite whatever the block holds next.
+ */
+void journal_log_bitmap(int is_data, uint32_t num, int used) {
+    if (depth == 0) return;
+
+    if (is_data && !used) {
+        Image **link = image_link(1, num);
+        Image *img = *link;
+        if (img) {
+            *link = img->next;
+            if (img->txn == txn_seq) img->dead = 1;   // Freed at commit
+            else free(img);
+        }
+    }
+
+    uint16_t type = is_data ? (used ? J_BLOCK_USED : J_BLOCK_FREE) : (used ? J_INODE_USED : J_INODE_FREE);
+    if (txn_bitmap_count > 0) {
+        JournalEntry *last = &txn_bitmap[txn_bitmap_count - 1];
+        if (last->type == type && last->num + last->count == num) {
+            last->count++;
+            return;
+        }
+    }
+    if (txn_bitmap_count == txn_bitmap_capacity) txn_bitmap = grow(txn_bitmap, &txn_bitmap_capacity, sizeof(JournalEntry));
+    txn_bitmap[txn_bitmap_count++] = (JournalEntry){ type, 0, num, 1 };
+}
+
+/**
+ * End a transaction. The outermost call queues its record for the journal;
+ * the record is written and durable after journal_sync(). Returns the
+ * transaction number to pass to journal_sync().
+ */
+uint64_t journal_commit() {
+    if (journal_fd < 0 || depth == 0 || --depth > 0) return txn_seq;
+
+    size_t checksum_count;
+    ChecksumUpdate *checksums = checksum_take_pending(&checksum_count);
+    size_t payload = txn_bitmap_count * sizeof(JournalEntry) + checksum_payload(checksums, checksum_count);
+    for (size_t i = 0; i < txn_image_count; ++i) {
+        if (!txn_images[i]->dead) payload += sizeof(JournalEntry) + image_size(txn_images[i]->is_data);
+    }
+
+    if (payload > 0) {
+        uint8_t *record = malloc(sizeof(JournalHeader) + payload);
+        if (!record) {
+            fprintf(stderr, "[journal] Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Bitmap changes first: a block freed and then rewritten in one
+        // transaction must replay as "free, then image"
+        uint8_t *p = record + sizeof(JournalHeader);
+        memcpy(p, txn_bitmap, txn_bitmap_count * sizeof(JournalEntry));
+        p += txn_bitmap_count * sizeof(JournalEntry);
+        for (size_t i = 0; i < checksum_count;) {
+            size_t run = 1;
+            while (i + run < checksum_count && checksums[i + run].block == checksums[i].block + run) run++;
+            JournalEntry e = { J_CHECKSUM, 0, checksums[i].block, (uint32_t)run };
+            memcpy(p, &e, sizeof(e));
+            p += sizeof(e);
+            for (size_t k = 0; k < run; ++k, p += sizeof(uint32_t)) memcpy(p, &checksums[i + k].crc, sizeof(uint32_t));
+            i += run;
+        }
+        for (size_t i = 0; i < txn_image_count; ++i) {
+            Image *img = txn_images[i];
+            if (img->dead) continue;
+            JournalEntry e = { img->is_data ? J_BLOCK : J_INODE, 0, img->num, (uint32_t)image_size(img->is_data) };
+            memcpy(p, &e, sizeof(e));
+            memcpy(p + sizeof(e), img->data, e.count);
+            p += sizeof(e) + e.count;
+        }
+
+        JournalHeader header = { JOURNAL_MAGIC, checksum(record + sizeof(JournalHeader), payload), txn_seq,
+                                 (uint32_t)payload, (uint32_t)num_inode_segments, (uint32_t)num_data_segments, 0 };
+        memcpy(record, &header, sizeof(header));
+
+        size_t len = sizeof(JournalHeader) + payload;
+        pthread_mutex_lock(&sync_lock);
+        if (queued_len + len > queued_capacity) {
+            size_t capacity = queued_capacity ? queued_capacity : 64 * 1024;
+            while (capacity < queued_len + len) capacity *= 2;
+            queued = realloc(queued, capacity);
+            if (!queued) {
+                fprintf(stderr, "[journal] Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            queued_capacity = capacity;
+        }
+        memcpy(queued + queued_len, record, len);
+        queued_len += len;
+        journal_bytes += len;
+        free(record);
+
+        committed_seq = txn_seq;
+        commit_count++;
+        int group_full = ++commits_since_sync >= JOURNAL_GROUP_COMMITS;
+        pthread_mutex_unlock(&sync_lock);
+        if (group_full) journal_sync(txn_seq);
+    }
+
+    for (size_t i = 0; i < txn_image_count; ++i) {
+        if (txn_images[i]->dead) free(txn_images[i]);
+    }
+    free(checksums);
+    txn_image_count = 0;
+    txn_bitmap_count = 0;
+    return txn_seq;
+}
+
+/**
+ * Make every transaction up to `seq` durable. One caller syncs the data
+ * segments, then writes and fdatasyncs every record queued so far while the
+ * others wait for it.
+ */
+void journal_sync(uint64_t seq) {
+    if (journal_fd < 0) return;
+    pthread_mutex_lock(&sync_lock);
+    if (seq > committed_seq) seq = committed_seq;
+    while (synced_seq < seq) {
+        if (sync_running) {
+            pthread_cond_wait(&sync_done, &sync_lock);
+            continue;
+        }
+        sync_running = 1;
+        uint64_t target = committed_seq;
+        commits_since_sync = 0;
+        uint8_t *records = queued;
+        size_t len = queued_len;
+        off_t offset = journal_bytes - (off_t)len;
+        queued = NULL;
+        queued_len = queued_capacity = 0;
+        pthread_mutex_unlock(&sync_lock);
+
+        sync_data_segments();   // File data before the records that point at it
+        if (pwrite(journal_fd, records, len, offset) != (ssize_t)len) {
+            perror("[journal] Failed to append transactions");
+            exit(EXIT_FAILURE);
+        }
+        free(records);
+        if (fdatasync(journal_fd) != 0) perror("[journal] fdatasync failed");
+
+        pthread_mutex_lock(&sync_lock);
+        synced_seq = target;
+        sync_count++;
+        sync_running = 0;
+        pthread_cond_broadcast(&sync_done);
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/**
+ * Make every committed transaction durable, for an exit in the middle of
+ * another one. Skipped when the exit came from inside a sync, which would
+ * otherwise wait for itself.
+ */
+void journal_sync_committed() {
+    pthread_mutex_lock(&sync_lock);
+    int running = sync_running;
+    uint64_t seq = committed_seq;
+    pthread_mutex_unlock(&sync_lock);
+    if (!running) journal_sync(seq);
+}
+
+/**
+ * Number of the open transaction, or of the last one when none is open.
+ */
+uint64_t journal_seq() {
+    return txn_seq;
+}
+
+/**
+ * Return 1 once transaction `seq` is on disk (always, without a journal).
+ * With `force`, syncs it first if it has been committed.
+ */
+int journal_durable(uint64_t seq, int force) {
+    if (journal_fd < 0) return 1;
+    if (force) journal_sync(seq);
+    pthread_mutex_lock(&sync_lock);
+    int durable = synced_seq >= seq;
+    pthread_mutex_unlock(&sync_lock);
+    return durable;
+}
+
+/**
+ * Make the journal durable, then write every captured image to its home
+ * location and drop it. Must not be called inside a transaction.
+ */
+void journal_apply() {
+    if (journal_fd < 0 || depth > 0) return;
+    journal_sync(committed_seq);
+    if (getenv("EXFS2_CRASH_BEFORE_CHECKPOINT") && committed_seq > 0) {
+        fprintf(stderr, "[journal] Simulating a crash before the checkpoint\n");   // For recovery tests
+        raise(SIGKILL);
+    }
+
+    for (int b = 0; b < JOURNAL_HASH; ++b) {
+        while (images[b]) {
+            Image *img = images[b];
+            images[b] = img->next;
+            int seg, off;
+            if (img->is_data) {
+                if (get_segment_and_block_offset(img->num, &seg, &off) < 0) {
+                    free(img);
+                    continue;
+                }
+                segment_write(1, seg, (size_t)off * BLOCK_SIZE, img->data, BLOCK_SIZE);
+                checksum_record(img->num, 1, img->data);
+            } else {
+                get_segment_and_inode_offset(img->num, &seg, &off);
+                segment_write(0, seg, (size_t)off * inode_size, img->data, inode_size);
+            }
+            free(img);
+        }
+    }
+}
+
+/**
+ * Empty the journal once everything it protects is on disk.
+ */
+static void journal_truncate() {
+    if (journal_bytes == 0) return;
+    if (syncfs(journal_fd) != 0) perror("[journal] syncfs failed");
+    if (ftruncate(journal_fd, 0) != 0 || fdatasync(journal_fd) != 0) perror("[journal] Failed to empty journal");
+    journal_bytes = 0;
+}
+
+/**
+ * Write all captured metadata home along with the block cache, bitmaps,
+ * dedup index and superblock, then empty the journal. Blocks freed since the
+ * last checkpoint are punched out once the journal holds their frees.
+ */
+void journal_checkpoint() {
+    if (journal_fd < 0 || depth > 0) return;
+    journal_apply();
+    bcache_flush();
+    sync_bitmaps();
+    dedup_sync();
+    reclaim_pending();
+    checksum_sync();
+    write_superblock();
+    journal_truncate();
+}
+
+/**
+ * Empty and close the journal at unmount. The caller has already applied it
+ * and written the block cache, bitmaps and superblock.
+ */
+void journal_close() {
+    if (journal_fd < 0) return;
+    journal_truncate();
+    if (getenv("EXFS2_CACHE_STATS") && commit_count > 0) {
+        fprintf(stderr, "[journal] %llu transactions committed with %llu syncs\n",
+                (unsigned long long)commit_count, (unsigned long long)sync_count);
+    }
+    close(journal_fd);
+    journal_fd = -1;
+}
+
+// Last position a block is freed at, for skipping stale images during replay
+typedef struct {
+    uint32_t block;                       // Block number + 1 (0 = empty slot)
+    uint64_t position;
+} FreedBlock;
+
+static FreedBlock *freed_slot(FreedBlock *table, size_t size, uint32_t block) {
+    size_t i = (block * 2654435761u) & (size - 1);
+    while (table[i].block && table[i].block != block + 1) i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+/**
+ * Return the length of the valid record at `offset`, or 0 at the end of
+ * the journal or a torn/corrupt record.
+ */
+static size_t record_length(const uint8_t *journal, size_t size, size_t offset) {
+    if (offset + sizeof(JournalHeader) > size) return 0;
+    JournalHeader h;
+    memcpy(&h, journal + offset, sizeof(h));
+    if (h.magic != JOURNAL_MAGIC || offset + sizeof(h) + h.length > size) return 0;
+    if (checksum(journal + offset + sizeof(h), h.length) != h.checksum) return 0;
+    return sizeof(h) + h.length;
+}
+
+/**
+ * Re-apply every complete transaction after an unclean shutdown, then
+ * checkpoint. Block images are skipped when a later record frees the block,
+ * since the block may have been reused for file data afterwards.
+ */
+void journal_replay() {
+    size_t size = (size_t)journal_bytes;
+    if (size == 0) return;
+    uint8_t *journal = malloc(size);
+    if (!journal || pread(journal_fd, journal, size, 0) != (ssize_t)size) {
+        fprintf(stderr, "[journal] Failed to read journal for replay\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // --- Pass 1: find valid records and where blocks are last freed ---
+    size_t valid = 0, frees = 0;
+    for (size_t len; (len = record_length(journal, size, valid)) > 0; valid += len) frees += len / sizeof(JournalEntry);
+    size_t table_size = 64;
+    while (table_size < 2 * frees) table_size *= 2;
+    FreedBlock *freed = calloc(table_size, sizeof(FreedBlock));
+    if (!freed) {
+        fprintf(stderr, "[journal] Out of memory for replay\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t off = 0; off < valid; off += record_length(journal, size, off)) {
+        const JournalHeader *h = (const JournalHeader *)(journal + off);
+        size_t end = off + sizeof(JournalHeader) + h->length;
+        for (size_t p = off + sizeof(JournalHeader); p < end;) {
+            JournalEntry e;
+            memcpy(&e, journal + p, sizeof(e));
+            if (e.type == J_BLOCK_FREE) {
+                for (uint32_t b = 0; b < e.count; ++b) {
+                    FreedBlock *slot = freed_slot(freed, table_size, e.num + b);
+                    slot->block = e.num + b + 1;
+                    slot->position = p;
+                }
+            }
+            p += sizeof(e) + entry_payload(&e);
+        }
+    }
+
+    // --- Pass 2: apply images and bitmap changes in order ---
+    int transactions = 0;
+    for (size_t off = 0; off < valid; off += record_length(journal, size, off)) {
+        JournalHeader h;
+        memcpy(&h, journal + off, sizeof(h));
+        if ((int)h.inode_segments > num_inode_segments) num_inode_segments = h.inode_segments;
+        if ((int)h.data_segments > num_data_segments) num_data_segments = h.data_segments;
+        if (h.seq > txn_seq) txn_seq = h.seq;
+
+        size_t end = off + sizeof(JournalHeader) + h.length;
+        for (size_t p = off + sizeof(JournalHeader); p < end;) {
+            JournalEntry e;
+            memcpy(&e, journal + p, sizeof(e));
+            const uint8_t *data = journal + p + sizeof(e);
+            if (e.type == J_INODE) {
+                Inode inode = {0};
+                memcpy(&inode, data, e.count < sizeof(Inode) ? e.count : sizeof(Inode));
+                write_inode(e.num, &inode);
+            } else if (e.type == J_BLOCK) {
+                FreedBlock *slot = freed_slot(freed, table_size, e.num);
+                if (!slot->block || slot->position < p) write_block_run(e.num, 1, data);
+            } else if (e.type == J_CHECKSUM) {
+                for (uint32_t b = 0; b < e.count; ++b) {
+                    uint32_t crc;
+                    memcpy(&crc, data + (size_t)b * sizeof(uint32_t), sizeof(crc));
+                    checksum_set(e.num + b, crc);
+                }
+            } else {
+                for (uint32_t n = e.num; n < e.num + e.count; ++n) {
+                    if (e.type == J_BLOCK_USED) mark_block_used(n);
+                    else if (e.type == J_BLOCK_FREE) mark_block_free(n);
+                    else if (e.type == J_INODE_USED) mark_inode_used(n);
+                    else mark_inode_free(n);
+                }
+            }
+            p += sizeof(e) + entry_payload(&e);
+        }
+        transactions++;
+    }
+    free(freed);
+    free(journal);
+
+    if (valid < size) fprintf(stderr, "[journal] Ignoring %zu bytes of incomplete transaction\n", size - valid);
+    fprintf(stderr, "[journal] Replayed %d transactions\n", transactions);
+    journal_checkpoint();
+}
@@ -9,38 +9,84 @@
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s -[a|l|r|e|D] ...\n", argv[0]);
+        fprintf(stderr, "Usage: %s -[i|a|b|s|S|C|l|r|e|D|V|T] ...\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    // Initialize the filesystem (load or create segment files)
-    init_filesystem();
+    // Client: ./exfs2 -C <socket> <command> [exfs_path [offset length]] talks to a server, no local mount
+    if (strcmp(argv[1], "-C") == 0 && argc >= 4 && argc <= 7) {
+        return run_client(argv[2], argv + 3, argc - 3);
+    }
+
+    // Inode size used if a new filesystem has to be created
+    uint32_t new_inode_size = DEFAULT_INODE_SIZE;
+    if (strcmp(argv[1], "-i") == 0 && argc == 3) {
+        new_inode_size = strcmp(argv[2], "block") == 0 ? INODE_SIZE_BLOCK : (uint32_t)atoi(argv[2]);
+        if (!valid_inode_size(new_inode_size)) {
+            fprintf(stderr, "Invalid inode size '%s' (use 128, 256 or block)\n", argv[2]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Initialize the filesystem (load or create superblock and segment files)
+    init_filesystem(new_inode_size);
 
     // Dispatch to appropriate command
-    if (strcmp(argv[1], "-a") == 0 && argc == 5 && strcmp(argv[3], "-f") == 0) {
-        // Add: ./exfs2 -a <exfs_path> -f <host_path>
-        run_add(argv[2], argv[4]);
+    if (strcmp(argv[1], "-i") == 0 && argc <= 3) {
+        // Init: ./exfs2 -i [128|256|block]
+        if (inode_size != new_inode_size && argc == 3) {
+            fprintf(stderr, "[init] Filesystem already exists with %u-byte inodes\n", inode_size);
+        }
+    } else if (strcmp(argv[1], "-a") == 0 && argc == 5 && strcmp(argv[3], "-f") == 0) {
+        // Add: ./exfs2 -a <exfs_path> -f <host_path|->
+        if (run_add(argv[2], argv[4]) < 0) return EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-b") == 0 && argc == 3) {
+        // Bulk add: ./exfs2 -b <manifest>
+        if (run_bulk_add(argv[2]) < 0) return EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-s") == 0 && argc == 3) {
+        // Script: ./exfs2 -s <script|->
+        if (run_script(argv[2]) < 0) return EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-S") == 0 && argc == 3) {
+        // Server: ./exfs2 -S <socket>
+        run_server(argv[2]);
     } else if (strcmp(argv[1], "-l") == 0) {
         // List all files and directories
-        run_list();
+        run_list(stdout);
     } else if (strcmp(argv[1], "-r") == 0 && argc == 3) {
         // Remove: ./exfs2 -r <exfs_path>
-        run_remove(argv[2]);
+        if (run_remove(argv[2]) < 0) return EXIT_FAILURE;
     } else if (strcmp(argv[1], "-e") == 0 && argc == 3) {
         // Extract: ./exfs2 -e <exfs_path>
-        run_extract(argv[2]);
+        if (run_extract(argv[2]) < 0) return EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-e") == 0 && argc == 5) {
+        // Ranged extract: ./exfs2 -e <exfs_path> <offset> <length>
+        if (run_extract_range(argv[2], strtoull(argv[3], NULL, 0), strtoull(argv[4], NULL, 0)) < 0) return EXIT_FAILURE;
     } else if (strcmp(argv[1], "-D") == 0 && argc == 3) {
         // Debug: ./exfs2 -D <exfs_path>
-        run_debug(argv[2]);
+        run_debug(argv[2], stdout);
+    } else if (strcmp(argv[1], "-V") == 0 && argc == 2) {
+        // Scrub: ./exfs2 -V verifies the checksum of every allocated block
+        if (run_scrub() > 0) return EXIT_FAILURE;
+    } else if (strcmp(argv[1], "-T") == 0 && argc == 2) {
+        // Trim: ./exfs2 -T punches every free block out of the segment files
+        run_trim();
     } else {
         // Invalid usage
         fprintf(stderr, "Invalid usage.\n");
         fprintf(stderr, "Valid commands:\n");
-        fprintf(stderr, "  %s -a <exfs_path> -f <host_path>   # Add file\n", argv[0]);
+        fprintf(stderr, "  %s -i [128|256|block]             # Initialize (inode size)\n", argv[0]);
+        fprintf(stderr, "  %s -a <exfs_path> -f <host_path>   # Add file (- reads stdin)\n", argv[0]);
+        fprintf(stderr, "  %s -b <manifest>                   # Bulk add '<exfs_path> <host_path>' lines\n", argv[0]);
+        fprintf(stderr, "  %s -s <script>                     # Run commands from a script (- reads stdin)\n", argv[0]);
+        fprintf(stderr, "  %s -S <socket>                     # Serve requests on a Unix socket\n", argv[0]);
+        fprintf(stderr, "  %s -C <socket> <cmd> [exfs_path]   # Client: add (stdin), extract [offset length], remove, list, stat\n", argv[0]);
         fprintf(stderr, "  %s -e <exfs_path>                  # Extract file\n", argv[0]);
+        fprintf(stderr, "  %s -e <exfs_path> <offset> <length> # Extract a byte range of a file\n", argv[0]);
         fprintf(stderr, "  %s -r <exfs_path>                  # Remove file\n", argv[0]);
         fprintf(stderr, "  %s -l                              # List files\n", argv[0]);
         fprintf(stderr, "  %s -D <exfs_path>                  # Debug file or directory\n", argv[0]);
+        fprintf(stderr, "  %s -V                              # Scrub: verify every block checksum\n", argv[0]);
+        fprintf(stderr, "  %s -T                              # Trim: give free space back to the host\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -0,0 +1,698 @@
+// output.c
+// Extract output path. extract first resolves the whole logical->physical
+// map into a list of runs (adjacent blocks within one segment are merged),
+// then output_flush() sends the runs to the output descriptor (stdout unless
+// output_set_fd() picked another). Runs go through
+// copy_file_range (regular file), splice (pipe) or sendfile, so the data never
+// passes through user space. When the kernel refuses, runs are read with
+// preadv into a reusable pool of aligned buffers and written with writev,
+// a batch of runs at a time (mmap segments are written straight from the
+// mapping). EXFS2_ZERO_COPY=0 forces the buffered path. Block checksums are
+// checked before a run is handed to the kernel: straight from the mapping
+// with the mmap engine, otherwise with a read through the buffer pool that
+// leaves the pages cached for the copy. Verified runs are read in whole
+// blocks, including the unsent rest of the last one.
+// With EXFS2_EXTRACT_THREADS=N (N > 1) a pool of reader threads fetches
+// upcoming chunks ahead of the writer into a bounded reorder window instead.
+// Holes in sparse files are sent from a static zero buffer, never read.
+// All state is per thread, so server threads can extract concurrently; a
+// thread that called output_use_private_fds() reads segments through its own
+// descriptors instead of the shared segment cache. A failed write (full disk,
+// closed pipe) or a block that fails its checksum stops the transfer;
+// output_report() returns the failure.
+
+#define _GNU_SOURCE
+#include "exfs2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)    // Bytes per pool buffer
+#define OUTPUT_POOL_BUFFERS 32            // Pool buffers (2MB), one writev per full pool
+#define PARALLEL_CHUNK (256 * 1024)       // Bytes fetched by one reader at a time
+#define PARALLEL_WINDOW_PER_THREAD 4      // Reorder slots per reader thread
+#define MAX_EXTRACT_THREADS 32
+
+enum { COPY_UNKNOWN, COPY_FILE_RANGE, COPY_SPLICE, COPY_SENDFILE, COPY_BUFFERED };
+
+typedef struct {
+    uint32_t start;                       // First block of the run
+    uint32_t blocks;                      // Blocks in the run
+    size_t bytes;                         // File bytes the run contributes
+} OutputRun;
+
+static __thread int out_fd = STDOUT_FILENO;        // Where extracted data goes
+static __thread int copy_method = COPY_UNKNOWN;
+static __thread OutputRun *runs = NULL;            // Resolved map of the file being extracted
+static __thread size_t run_count = 0, run_capacity = 0;
+static __thread uint8_t *pool = NULL;              // OUTPUT_POOL_BUFFERS aligned buffers
+static __thread int *private_fds = NULL;           // Own read-only segment fds (-1 = not open), or NULL
+static __thread int private_fd_count = 0;
+static __thread uint64_t kernel_bytes = 0;         // Bytes moved without a user-space copy
+static __thread int used_method = COPY_BUFFERED;   // Last kernel call that moved data
+static __thread uint64_t preadv_calls = 0, writev_calls = 0, buffered_bytes = 0;
+static __thread int extract_threads = -1;          // Reader threads (1 = serial), from EXFS2_EXTRACT_THREADS
+static __thread uint64_t parallel_bytes = 0, parallel_chunks = 0;
+static __thread uint64_t hole_bytes = 0;          // Zeros synthesized for holes
+static __thread uint64_t verified_bytes = 0;      // Bytes checked before a kernel copy
+static __thread int output_failed = 0;             // A write or a checksum failed: send nothing more
+
+static const uint8_t zero_buffer[OUTPUT_BUFFER_SIZE];   // Source of the zeros sent for holes
+
+// A slice of a run fetched by one reader
+typedef struct {
+    int seg;
+    uint32_t block;                       // First block of the chunk
+    size_t offset;                        // Byte offset in the segment
+    size_t len;                           // Bytes to send
+    size_t span;                          // Bytes to read (whole blocks when verifying)
+} Chunk;
+
+// Shared state of one parallel transfer
+typedef struct {
+    Chunk *chunks;
+    size_t count;
+    size_t window;                        // Reorder slots
+    uint8_t *slots;                       // window * PARALLEL_CHUNK bytes
+    long *slot_chunk;                     // Chunk held by each slot (-1 = none)
+    size_t next_fetch;                    // Next chunk handed to a reader
+    size_t next_write;                    // Next chunk the writer needs
+    int *fds;                             // Private read-only segment fds (-1 = not open)
+    int verify;                           // Readers check block checksums
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ParallelState;
+
+/**
+ * Grow a table of segment descriptors to cover segment `seg`; new entries are -1.
+ */
+static int *grow_fds(int *fds, int *count, int seg) {
+    if (seg < *count) return fds;
+    int capacity = *count ? *count : 64;
+    while (capacity <= seg) capacity *= 2;
+    fds = realloc(fds, (size_t)capacity * sizeof(int));
+    if (!fds) {
+        fprintf(stderr, "[output] Out of memory for segment descriptors\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = *count; i < capacity; ++i) fds[i] = -1;
+    *count = capacity;
+    return fds;
+}
+
+/**
+ * Descriptor to read data segment `seg` from: the calling thread's own one
+ * after output_use_private_fds(), the shared segment cache's otherwise.
+ */
+static int source_fd(int seg) {
+    if (!private_fds) return segment_fd(1, seg);
+    private_fds = grow_fds(private_fds, &private_fd_count, seg);   // Writers may have added segments
+    if (private_fds[seg] < 0) {
+        char filename[64];
+        segment_filename(1, seg, filename, sizeof(filename));
+        private_fds[seg] = open(filename, O_RDONLY);
+        if (private_fds[seg] < 0) perror("[output] Failed to open segment");
+    }
+    return private_fds[seg];
+}
+
+static const char *method_name(int method) {
+    switch (method) {
+        case COPY_FILE_RANGE: return "copy_file_range";
+        case COPY_SPLICE:     return "splice";
+        case COPY_SENDFILE:   return "sendfile";
+        default:              return "buffered copy";
+    }
+}
+
+/**
+ * Pick the first kernel copy call worth trying for the output descriptor.
+ */
+static int initial_method() {
+    const char *env = getenv("EXFS2_ZERO_COPY");
+    if (env && strcmp(env, "0") == 0) return COPY_BUFFERED;
+
+    struct stat st;
+    if (fstat(out_fd, &st) != 0) return COPY_BUFFERED;
+    if (S_ISFIFO(st.st_mode)) return COPY_SPLICE;
+    if (S_ISREG(st.st_mode)) return COPY_FILE_RANGE;
+    return COPY_SENDFILE;
+}
+
+/**
+ * Move up to `len` bytes at `offset` of `in_fd` to the output with the current
+ * kernel copy method, stepping down to the next method when one is not
+ * supported. Returns the number of bytes moved.
+ */
+static size_t kernel_copy(int in_fd, off_t offset, size_t len) {
+    size_t done = 0;
+    while (done < len && copy_method != COPY_BUFFERED) {
+        ssize_t n;
+        loff_t off = offset + done;
+        if (copy_method == COPY_FILE_RANGE) {
+            n = copy_file_range(in_fd, &off, out_fd, NULL, len - done, 0);
+        } else if (copy_method == COPY_SPLICE) {
+            n = splice(in_fd, &off, out_fd, NULL, len - done, SPLICE_F_MOVE);
+        } else {
+            off_t send_off = offset + done;
+            n = sendfile(out_fd, in_fd, &send_off, len - done);
+        }
+
+        if (n > 0) {
+            done += n;
+            used_method = copy_method;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+
+        // Unsupported for this pair of files: fall back to the next method
+        copy_method = (copy_method == COPY_SENDFILE) ? COPY_BUFFERED : COPY_SENDFILE;
+    }
+    kernel_bytes += done;
+    return done;
+}
+
+/**
+ * Write all iovecs to the output descriptor, resuming after short writes.
+ * Returns -1 (and fails the extract) if the output cannot take the data.
+ */
+static int write_all(struct iovec *iov, int count) {
+    if (output_failed) return -1;
+    while (count > 0) {
+        ssize_t n = writev(out_fd, iov, count);
+        writev_calls++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[output] writev failed");
+            output_failed = 1;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Allocate the calling thread's buffer pool. Returns -1 (and fails the
+ * extract) if there is no memory for it.
+ */
+static int ensure_pool() {
+    if (pool) return 0;
+    if (posix_memalign((void **)&pool, BLOCK_SIZE, (size_t)OUTPUT_POOL_BUFFERS * OUTPUT_BUFFER_SIZE) != 0) {
+        pool = NULL;
+        fprintf(stderr, "[output] Out of memory allocating buffer pool\n");
+        output_failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check the checksums of a whole run before the kernel copies it. With the
+ * mmap engine the mapping is checked in place; otherwise the run is read
+ * through the buffer pool a pool at a time. Returns -1 if a block is corrupt.
+ */
+static int verify_run(const OutputRun *run) {
+    int seg, blk;
+    get_segment_and_block_offset(run->start, &seg, &blk);
+    size_t offset = (size_t)blk * BLOCK_SIZE, len = (size_t)run->blocks * BLOCK_SIZE;
+    verified_bytes += run->bytes;
+
+    const uint8_t *mapped = private_fds ? NULL : segment_ptr(1, seg, offset, len);
+    if (mapped) return checksum_verify(run->start, run->blocks, mapped) > 0 ? -1 : 0;
+
+    if (ensure_pool() < 0) return -1;
+    const size_t pool_size = (size_t)OUTPUT_POOL_BUFFERS * OUTPUT_BUFFER_SIZE;
+    for (size_t done = 0; done < len; done += pool_size) {
+        size_t piece = len - done < pool_size ? len - done : pool_size;
+        ssize_t got = pread(source_fd(seg), pool, piece, (off_t)(offset + done));
+        size_t have = got > 0 ? (size_t)got : 0;
+        if (have < piece) memset(pool + have, 0, piece - have);   // Past the end of the file
+        if (checksum_verify(run->start + (uint32_t)(done / BLOCK_SIZE), (uint32_t)(piece / BLOCK_SIZE), pool) > 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send byte range [skip, bytes) of each run through the buffer pool: every run
+ * piece is read with one preadv, and a full pool is written with one writev.
+ * Runs already partly sent by the kernel were verified before that copy.
+ */
+static void send_buffered(const OutputRun *list, const size_t *skip, size_t count) {
+    if (ensure_pool() < 0) return;
+
+    struct iovec out[OUTPUT_POOL_BUFFERS];
+    int used = 0;
+
+    for (size_t r = 0; r < count && !output_failed; ++r) {
+        int seg, blk;
+        get_segment_and_block_offset(list[r].start, &seg, &blk);
+        size_t offset = (size_t)blk * BLOCK_SIZE + skip[r];
+        size_t left = list[r].bytes - skip[r];
+        int verify = checksum_verify_enabled() && skip[r] == 0;
+        size_t tail = verify ? (size_t)list[r].blocks * BLOCK_SIZE - list[r].bytes : 0;   // Read only to verify
+
+        // mmap engine: write straight from the mapping, no staging copy
+        const uint8_t *mapped = private_fds ? NULL : segment_ptr(1, seg, offset, left + tail);
+        if (mapped) {
+            if (used > 0) write_all(out, used);
+            used = 0;
+            if (verify && checksum_verify(list[r].start, list[r].blocks, mapped) > 0) {
+                output_failed = 1;
+                break;
+            }
+            struct iovec direct = { (void *)mapped, left };
+            write_all(&direct, 1);
+            buffered_bytes += left;
+            continue;
+        }
+
+        while (left > 0 && !output_failed) {
+            if (used == OUTPUT_POOL_BUFFERS) {
+                write_all(out, used);
+                used = 0;
+            }
+
+            // One preadv fills as many free pool buffers as this piece needs
+            struct iovec in[OUTPUT_POOL_BUFFERS];
+            int n_in = 0;
+            size_t piece = 0, want = left + tail;
+            while (used + n_in < OUTPUT_POOL_BUFFERS && piece < want) {
+                size_t len = want - piece < OUTPUT_BUFFER_SIZE ? want - piece : OUTPUT_BUFFER_SIZE;
+                in[n_in].iov_base = pool + (size_t)(used + n_in) * OUTPUT_BUFFER_SIZE;
+                in[n_in].iov_len = len;
+                piece += len;
+                n_in++;
+            }
+
+            ssize_t got = preadv(source_fd(seg), in, n_in, (off_t)offset);
+            preadv_calls++;
+            if (got < (ssize_t)piece) {
+                // Short read past the end of the segment file reads as zeros
+                size_t have = got > 0 ? (size_t)got : 0;
+                for (int i = 0; i < n_in; ++i) {
+                    size_t len = in[i].iov_len;
+                    if (have >= len) {
+                        have -= len;
+                    } else {
+                        memset((uint8_t *)in[i].iov_base + have, 0, len - have);
+                        have = 0;
+                    }
+                }
+            }
+
+            // Pool buffers are contiguous, so the piece is verified in one call
+            if (verify) {
+                uint32_t first = list[r].start + (uint32_t)((offset - (size_t)blk * BLOCK_SIZE) / BLOCK_SIZE);
+                if (checksum_verify(first, (uint32_t)(piece / BLOCK_SIZE), pool + (size_t)used * OUTPUT_BUFFER_SIZE) > 0) {
+                    output_failed = 1;   // The corrupt piece and the rest are not sent
+                    break;
+                }
+            }
+
+            // Send only file bytes: the tail read for verification is dropped
+            size_t send = piece < left ? piece : left;
+            size_t kept = 0;
+            for (int i = 0; i < n_in && kept < send; ++i) {
+                if (in[i].iov_len > send - kept) in[i].iov_len = send - kept;
+                kept += in[i].iov_len;
+                out[used++] = in[i];
+            }
+            offset += piece;
+            tail -= piece - send;
+            left -= send;
+            buffered_bytes += send;
+        }
+    }
+    if (used > 0 && !output_failed) write_all(out, used);
+}
+
+/**
+ * Return the reader's private fd for a segment. Called with the lock held.
+ */
+static int parallel_fd(ParallelState *ps, int seg) {
+    if (ps->fds[seg] < 0) {
+        char filename[64];
+        segment_filename(1, seg, filename, sizeof(filename));
+        ps->fds[seg] = open(filename, O_RDONLY);
+        if (ps->fds[seg] < 0) {
+            perror("[output] Failed to open segment for readahead");
+            ps->failed = 1;
+        }
+    }
+    return ps->fds[seg];
+}
+
+/**
+ * Reader thread: fetch chunks in order while they fit in the reorder window.
+ */
+static void *parallel_reader(void *arg) {
+    ParallelState *ps = arg;
+    pthread_mutex_lock(&ps->lock);
+    for (;;) {
+        while (!ps->failed && ps->next_fetch < ps->count && ps->next_fetch >= ps->next_write + ps->window) {
+            pthread_cond_wait(&ps->changed, &ps->lock);
+        }
+        if (ps->failed || ps->next_fetch >= ps->count) break;
+
+        size_t i = ps->next_fetch++;
+        Chunk *c = &ps->chunks[i];
+        int fd = parallel_fd(ps, c->seg);
+        pthread_mutex_unlock(&ps->lock);
+
+        uint8_t *dst = ps->slots + (i % ps->window) * PARALLEL_CHUNK;
+        size_t got = 0;
+        while (fd >= 0 && got < c->span) {
+            ssize_t n = pread(fd, dst + got, c->span - got, (off_t)(c->offset + got));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got < c->span) memset(dst + got, 0, c->span - got);   // Past the end of the file
+        int corrupt = ps->verify && checksum_verify(c->block, (uint32_t)(c->span / BLOCK_SIZE), dst) > 0;
+
+        pthread_mutex_lock(&ps->lock);
+        if (corrupt) ps->failed = 1;   // The writer stops before this chunk
+        else ps->slot_chunk[i % ps->window] = (long)i;
+        pthread_cond_broadcast(&ps->changed);
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+static void advise_chunk(const Chunk *c) {
+    int seg_fd = source_fd(c->seg);
+    posix_fadvise(seg_fd, (off_t)c->offset, (off_t)c->len, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * Send runs with `threads` readers fetching ahead of the writer. Chunks are
+ * written strictly in order from a bounded reorder window; each chunk gets a
+ * WILLNEED hint one window before a reader picks it up.
+ */
+static void send_parallel(const OutputRun *list, size_t count, int threads) {
+    ParallelState ps;
+    memset(&ps, 0, sizeof(ps));
+    int fd_count = 0;
+    ps.fds = grow_fds(NULL, &fd_count, num_data_segments);
+
+    // --- Split runs into chunks ---
+    size_t capacity = 0;
+    for (size_t r = 0; r < count; ++r) capacity += (list[r].bytes + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    ps.chunks = malloc(capacity * sizeof(Chunk));
+    ps.verify = checksum_verify_enabled();
+    for (size_t r = 0; r < count; ++r) {
+        int seg, blk;
+        get_segment_and_block_offset(list[r].start, &seg, &blk);
+        for (size_t done = 0; done < list[r].bytes; done += PARALLEL_CHUNK) {
+            Chunk *c = &ps.chunks[ps.count++];
+            c->seg = seg;
+            c->block = list[r].start + (uint32_t)(done / BLOCK_SIZE);
+            c->offset = (size_t)blk * BLOCK_SIZE + done;
+            c->len = list[r].bytes - done < PARALLEL_CHUNK ? list[r].bytes - done : PARALLEL_CHUNK;
+            c->span = ps.verify ? (c->len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE : c->len;
+        }
+    }
+
+    ps.window = (size_t)threads * PARALLEL_WINDOW_PER_THREAD;
+    ps.slots = malloc(ps.window * PARALLEL_CHUNK);
+    ps.slot_chunk = malloc(ps.window * sizeof(long));
+    if (!ps.chunks || !ps.slots || !ps.slot_chunk) {
+        fprintf(stderr, "[output] Out of memory for parallel extract\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < ps.window; ++i) ps.slot_chunk[i] = -1;
+    pthread_mutex_init(&ps.lock, NULL);
+    pthread_cond_init(&ps.changed, NULL);
+
+    // Hint the first two windows before the readers start
+    for (size_t i = 0; i < ps.count && i < 2 * ps.window; ++i) advise_chunk(&ps.chunks[i]);
+
+    pthread_t readers[MAX_EXTRACT_THREADS];
+    for (int t = 0; t < threads; ++t) pthread_create(&readers[t], NULL, parallel_reader, &ps);
+
+    // --- Writer: emit chunks in order ---
+    for (size_t i = 0; i < ps.count; ++i) {
+        size_t ahead = i + 2 * ps.window;
+        if (ahead < ps.count) advise_chunk(&ps.chunks[ahead]);
+
+        pthread_mutex_lock(&ps.lock);
+        while (!ps.failed && ps.slot_chunk[i % ps.window] != (long)i) {
+            pthread_cond_wait(&ps.changed, &ps.lock);
+        }
+        int failed = ps.failed;
+        pthread_mutex_unlock(&ps.lock);
+        if (failed) break;
+
+        struct iovec iov = { ps.slots + (i % ps.window) * PARALLEL_CHUNK, ps.chunks[i].len };
+        if (write_all(&iov, 1) < 0) break;
+        parallel_bytes += ps.chunks[i].len;
+
+        pthread_mutex_lock(&ps.lock);
+        ps.slot_chunk[i % ps.window] = -1;
+        ps.next_write = i + 1;
+        pthread_cond_broadcast(&ps.changed);
+        pthread_mutex_unlock(&ps.lock);
+    }
+
+    pthread_mutex_lock(&ps.lock);
+    if (ps.next_write < ps.count) {   // Stop readers after an error
+        ps.failed = 1;
+        output_failed = 1;
+    }
+    pthread_cond_broadcast(&ps.changed);
+    pthread_mutex_unlock(&ps.lock);
+    for (int t = 0; t < threads; ++t) pthread_join(readers[t], NULL);
+
+    for (int i = 0; i < fd_count; ++i) {
+        if (ps.fds[i] >= 0) close(ps.fds[i]);
+    }
+    free(ps.fds);
+    parallel_chunks += ps.count;
+    pthread_mutex_destroy(&ps.lock);
+    pthread_cond_destroy(&ps.changed);
+    free(ps.chunks);
+    free(ps.slots);
+    free(ps.slot_chunk);
+}
+
+/**
+ * Send extracted data to `fd` from now on (the caller keeps ownership of it).
+ */
+void output_set_fd(int fd) {
+    fflush(stdout);
+    out_fd = fd;
+    copy_method = COPY_UNKNOWN;   // Re-probe: the new target may be a pipe or a file
+}
+
+/**
+ * Make the calling thread read segments through descriptors of its own, which
+ * other threads' segment cache evictions cannot close underneath it. The
+ * caller must have flushed the block cache and segment files.
+ */
+void output_use_private_fds() {
+    if (private_fds) return;
+    private_fds = grow_fds(NULL, &private_fd_count, num_data_segments);
+}
+
+/**
+ * Free the calling thread's output buffers and descriptors (before the thread exits).
+ */
+void output_release() {
+    if (private_fds) {
+        for (int i = 0; i < private_fd_count; ++i) {
+            if (private_fds[i] >= 0) close(private_fds[i]);
+        }
+        free(private_fds);
+        private_fds = NULL;
+        private_fd_count = 0;
+    }
+    free(pool);
+    free(runs);
+    pool = NULL;
+    runs = NULL;
+    run_count = run_capacity = 0;
+}
+
+/**
+ * Write bytes held in memory (inline file data) to the output descriptor.
+ */
+void output_data(const void *data, size_t len) {
+    if (len == 0) return;
+    fflush(stdout);
+    struct iovec iov = { (void *)data, len };
+    write_all(&iov, 1);
+}
+
+/**
+ * Send `len` zero bytes for a hole in a sparse file, after the queued runs.
+ * Nothing is read: every iovec points at the same zero buffer.
+ */
+void output_zeros(uint64_t len) {
+    if (len == 0 || output_failed) return;
+    output_flush();
+    fflush(stdout);
+    hole_bytes += len;
+
+    struct iovec iov[OUTPUT_POOL_BUFFERS];
+    while (len > 0) {
+        int count = 0;
+        while (count < OUTPUT_POOL_BUFFERS && len > 0) {
+            size_t piece = len < OUTPUT_BUFFER_SIZE ? (size_t)len : OUTPUT_BUFFER_SIZE;
+            iov[count].iov_base = (void *)zero_buffer;
+            iov[count++].iov_len = piece;
+            len -= piece;
+        }
+        if (write_all(iov, count) < 0) return;
+    }
+}
+
+/**
+ * Queue `bytes` of file data stored in `blocks` blocks starting at `start`.
+ * Runs that continue the previous one within the same segment are merged.
+ */
+void output_run(uint32_t start, uint32_t blocks, size_t bytes) {
+    if (blocks == 0 || bytes == 0) return;
+    int seg, blk;
+    if (start + blocks < start || get_segment_and_block_offset(start + blocks - 1, &seg, &blk) < 0) {
+        output_abort();   // A damaged pointer or extent: the runs sent later use checked numbers
+        return;
+    }
+
+    if (run_count > 0) {
+        OutputRun *last = &runs[run_count - 1];
+        if (start == last->start + last->blocks && last->bytes == (size_t)last->blocks * BLOCK_SIZE &&
+            start / BLOCKS_PER_SEGMENT == last->start / BLOCKS_PER_SEGMENT) {
+            last->blocks += blocks;
+            last->bytes += bytes;
+            return;
+        }
+    }
+
+    if (run_count == run_capacity) {
+        run_capacity = run_capacity ? run_capacity * 2 : 64;
+        runs = realloc(runs, run_capacity * sizeof(OutputRun));
+        if (!runs) {
+            fprintf(stderr, "[output] Out of memory building block map\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    runs[run_count].start = start;
+    runs[run_count].blocks = blocks;
+    runs[run_count].bytes = bytes;
+    run_count++;
+}
+
+/**
+ * Queue up to one block of file data.
+ */
+void output_block(uint32_t block_num, uint32_t bytes) {
+    output_run(block_num, 1, bytes);
+}
+
+/**
+ * Send every queued run to the output descriptor, in order.
+ */
+void output_flush() {
+    if (output_failed) run_count = 0;
+    if (run_count == 0) return;
+    if (copy_method == COPY_UNKNOWN) copy_method = initial_method();
+    if (extract_threads < 0) {
+        const char *env = getenv("EXFS2_EXTRACT_THREADS");
+        extract_threads = env ? atoi(env) : 1;
+        if (extract_threads < 1) extract_threads = 1;
+        if (extract_threads > MAX_EXTRACT_THREADS) extract_threads = MAX_EXTRACT_THREADS;
+    }
+    fflush(stdout);
+
+    if (extract_threads > 1) {
+        for (size_t r = 0; r < run_count; ++r) bcache_write_back(runs[r].start, runs[r].blocks);
+        flush_all_segments();
+        send_parallel(runs, run_count, extract_threads);
+        run_count = 0;
+        return;
+    }
+
+    size_t *skip = calloc(run_count, sizeof(size_t));   // Bytes of each run already sent
+    if (!skip) {
+        fprintf(stderr, "[output] Out of memory sending block map\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t r = 0;
+    while (r < run_count && !output_failed) {
+        bcache_write_back(runs[r].start, runs[r].blocks);
+
+        if (copy_method != COPY_BUFFERED) {
+            if (checksum_verify_enabled() && verify_run(&runs[r]) < 0) {
+                output_failed = 1;   // The corrupt run and the rest are not sent
+                break;
+            }
+            int seg, blk;
+            get_segment_and_block_offset(runs[r].start, &seg, &blk);
+            skip[r] = kernel_copy(source_fd(seg), (off_t)blk * BLOCK_SIZE, runs[r].bytes);
+            if (skip[r] == runs[r].bytes) {
+                r++;
+                continue;
+            }
+        }
+
+        // The kernel path is unavailable from here on: batch the rest
+        for (size_t k = r + 1; k < run_count; ++k) bcache_write_back(runs[k].start, runs[k].blocks);
+        send_buffered(runs + r, skip + r, run_count - r);
+        break;
+    }
+
+    free(skip);
+    run_count = 0;
+}
+
+/**
+ * Fail the current extract (a block it needs is unreadable): nothing more is
+ * sent, and output_report() returns -1.
+ */
+void output_abort() {
+    output_failed = 1;
+    run_count = 0;
+}
+
+/**
+ * Print how the extracted data was sent, then reset the counters for the next
+ * extract. Returns -1 if any of the data could not be sent.
+ */
+int output_report() {
+    if (parallel_bytes > 0) {
+        fprintf(stderr, "[extract] %llu bytes read ahead by %d threads in %llu chunks\n",
+                (unsigned long long)parallel_bytes, extract_threads, (unsigned long long)parallel_chunks);
+    }
+    if (kernel_bytes > 0) {
+        fprintf(stderr, "[extract] %llu bytes sent with %s (%llu verified first)\n", (unsigned long long)kernel_bytes,
+                method_name(used_method), (unsigned long long)verified_bytes);
+    }
+    if (buffered_bytes > 0) {
+        fprintf(stderr, "[extract] %llu bytes copied with %llu preadv and %llu writev calls\n",
+                (unsigned long long)buffered_bytes, (unsigned long long)preadv_calls,
+                (unsigned long long)writev_calls);
+    }
+    if (hole_bytes > 0) {
+        fprintf(stderr, "[extract] %llu bytes of holes sent as zeros\n", (unsigned long long)hole_bytes);
+    }
+    kernel_bytes = buffered_bytes = preadv_calls = writev_calls = 0;
+    parallel_bytes = parallel_chunks = hole_bytes = verified_bytes = 0;
+
+    int status = output_failed ? -1 : 0;
+    output_failed = 0;
+    return status;
+}
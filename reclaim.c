@@ -0,0 +1,149 @@
+// reclaim.c
+// Deferred space reclamation. Freeing a block only clears its bit in the
+// bitmap; the block is remembered here and its space is given back to the
+// host filesystem at the next checkpoint, once the journal holds the change
+// durably, by punching a hole (fallocate(FALLOC_FL_PUNCH_HOLE)) in its segment
+// file. A hole reads back as zeros. Blocks that were allocated again in the
+// meantime are left alone. Trim (-T) punches every free run of every data
+// segment instead, for space freed before a crash or by older versions.
+
+#define _GNU_SOURCE
+#include "exfs2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Freed blocks [start, start + count) waiting for the next checkpoint
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} FreedRun;
+
+static FreedRun *pending = NULL;
+static size_t pending_count = 0, pending_capacity = 0;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;   // Bulk workers free blocks concurrently
+static int punch_supported = 1;
+
+/**
+ * Remember a freed block for the next checkpoint. Consecutive blocks are
+ * merged into one run.
+ */
+void reclaim_defer(uint32_t block_num) {
+    pthread_mutex_lock(&reclaim_lock);
+    FreedRun *last = pending_count ? &pending[pending_count - 1] : NULL;
+    if (last && block_num == last->start + last->count) {
+        last->count++;
+    } else {
+        if (pending_count == pending_capacity) {
+            size_t capacity = pending_capacity ? pending_capacity * 2 : 64;
+            FreedRun *grown = realloc(pending, capacity * sizeof(FreedRun));
+            if (!grown) {   // The space is only reclaimed later, by trim
+                pthread_mutex_unlock(&reclaim_lock);
+                return;
+            }
+            pending = grown;
+            pending_capacity = capacity;
+        }
+        pending[pending_count++] = (FreedRun){ block_num, 1 };
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * Punch `count` blocks of one data segment starting at `start` out of its
+ * segment file and drop their checksums. Returns -1 if the host filesystem
+ * cannot punch holes.
+ */
+static int punch_run(uint32_t start, uint32_t count) {
+    if (!punch_supported) return -1;
+    int seg = start / BLOCKS_PER_SEGMENT;
+    off_t offset = (off_t)(start % BLOCKS_PER_SEGMENT) * BLOCK_SIZE;
+    if (fallocate(segment_fd(1, seg), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, (off_t)count * BLOCK_SIZE) != 0) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            fprintf(stderr, "[reclaim] The host filesystem cannot punch holes, freed space stays in the segment files\n");
+            punch_supported = 0;
+        } else {
+            perror("[reclaim] fallocate failed");
+        }
+        return -1;
+    }
+    checksum_clear(start, count);   // A hole has no checksum
+    return 0;
+}
+
+/**
+ * Punch the blocks of [start, start + count) that are still free, one
+ * segment run at a time. Returns the number of blocks punched.
+ */
+static uint64_t punch_free_blocks(uint32_t start, uint32_t count, uint64_t *runs) {
+    uint64_t punched = 0;
+    uint32_t end = start + count;
+    for (uint32_t b = start; b < end;) {
+        if (block_is_used(b) || b % BLOCKS_PER_SEGMENT == 0) {   // Reallocated, or reserved
+            b++;
+            continue;
+        }
+        uint32_t segment_end = (b / BLOCKS_PER_SEGMENT + 1) * BLOCKS_PER_SEGMENT;
+        uint32_t run = 1;
+        while (b + run < end && b + run < segment_end && !block_is_used(b + run)) run++;
+        if (punch_run(b, run) < 0) return punched;
+        punched += run;
+        (*runs)++;
+        b += run;
+    }
+    return punched;
+}
+
+/**
+ * Punch out the blocks freed since the last checkpoint that are still free.
+ * Called by the checkpoint after the journal and the block cache are on disk.
+ */
+void reclaim_pending() {
+    pthread_mutex_lock(&reclaim_lock);
+    FreedRun *runs = pending;
+    size_t count = pending_count;
+    pending = NULL;
+    pending_count = pending_capacity = 0;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    uint64_t punched = 0, holes = 0;
+    for (size_t i = 0; i < count; ++i) punched += punch_free_blocks(runs[i].start, runs[i].count, &holes);
+    free(runs);
+    if (punched > 0) {
+        fprintf(stderr, "[reclaim] %llu freed blocks punched out of the segment files (%llu runs)\n",
+                (unsigned long long)punched, (unsigned long long)holes);
+    }
+}
+
+/**
+ * Return the disk space used by the data segment files, in bytes.
+ */
+static uint64_t segment_disk_usage() {
+    uint64_t bytes = 0;
+    for (int seg = 0; seg < num_data_segments; ++seg) {
+        struct stat st;
+        if (fstat(segment_fd(1, seg), &st) == 0) bytes += (uint64_t)st.st_blocks * 512;
+    }
+    return bytes;
+}
+
+/**
+ * Punch every free block of every data segment out of its segment file.
+ * Returns the number of blocks punched.
+ */
+uint64_t run_trim() {
+    journal_checkpoint();   // Frees must be durable before their blocks lose their contents
+    uint64_t before = segment_disk_usage();
+
+    uint64_t punched = 0, runs = 0;
+    for (int seg = 0; seg < num_data_segments && punch_supported; ++seg) {
+        punched += punch_free_blocks((uint32_t)seg * BLOCKS_PER_SEGMENT, BLOCKS_PER_SEGMENT, &runs);
+    }
+
+    uint64_t after = segment_disk_usage();
+    fprintf(stderr, "[trim] %llu free blocks in %llu runs punched across %d segments\n", (unsigned long long)punched,
+            (unsigned long long)runs, num_data_segments);
+    fprintf(stderr, "[trim] Segment files use %.1f MB on disk (was %.1f MB)\n", after / 1048576.0, before / 1048576.0);
+    return punched;
+}
@@ -3,10 +3,83 @@
 #include <string.h>
 #include <stdint.h>
 
+static int count_entry(uint32_t inode_num, const char *name, void *ctx) {
+    (void)inode_num;
+    (void)name;
+    (*(int *)ctx)++;
+    return 1;   // One entry is enough to know the directory is not empty
+}
+
+/**
+ * Drop a file's reference to a data block, freeing it unless another file
+ * still shares it.
+ */
+static void release_data_block(uint32_t block_num) {
+    if (dedup_release(block_num) > 0) return;
+    mark_block_free(block_num);
+}
+
+/**
+ * Free the blocks under an indirect pointer block `levels` deep, then the
+ * pointer block itself.
+ */
+static void release_indirect(uint32_t block_num, int levels) {
+    if (block_num == 0) return;
+
+    uint32_t blocks[PTRS_PER_BLOCK] = {0};
+    extract_block_list(block_num, blocks, PTRS_PER_BLOCK);
+    for (uint32_t i = 0; i < PTRS_PER_BLOCK; ++i) {
+        if (blocks[i] == 0) continue;   // Hole
+        if (levels > 1) {
+            release_indirect(blocks[i], levels - 1);
+        } else {
+            release_data_block(blocks[i]);
+        }
+    }
+
+    mark_block_free(block_num);
+}
+
+static int release_chunk(const CompressedChunk *chunk, void *ctx) {
+    (void)ctx;
+    for (uint32_t b = 0; b < chunk_blocks(chunk); ++b) mark_block_free(chunk->start + b);
+    return 0;
+}
+
+/**
+ * Free every data and pointer block a file inode refers to. Data blocks
+ * shared through dedup only lose a reference. The stored runs of a
+ * compressed file go first, then its chunk tables with the pointer blocks.
+ * Only the bitmaps change here: nothing is written to the blocks, whose space
+ * is punched out of the segment files at the next checkpoint.
+ */
+void release_file_blocks(const Inode *inode) {
+    // --- Compressed chunks ---
+    if (inode->flags & INODE_COMPRESSED) compressed_foreach(inode, release_chunk, NULL);
+
+    // --- Extents ---
+    if (inode->flags & INODE_EXTENTS) {
+        for (int e = 0; e < inode->extent_count; ++e) {
+            for (uint32_t b = 0; b < inode->extents[e].length; ++b) release_data_block(inode->extents[e].start + b);
+        }
+    }
+
+    // --- Direct blocks ---
+    for (uint32_t i = 0; i < DIRECT_BLOCKS; ++i) {
+        if (inode->direct[i] != 0) release_data_block(inode->direct[i]);
+    }
+
+    // --- Single, double and triple indirect ---
+    release_indirect(inode->indirect_single, 1);
+    release_indirect(inode->indirect_double, 2);
+    if (!(inode->flags & (INODE_EXTENTS | INODE_INLINE))) release_indirect(inode->large.indirect_triple, 3);
+}
+
 /**
  * Remove a file from the file system and free all its associated blocks.
+ * Returns 0 on success, -1 on failure.
  */
-void run_remove(const char *exfs_path) {
+static int remove_path(const char *exfs_path) {
     fprintf(stderr, "[remove] Removing '%s'\n", exfs_path);
 
     char path_copy[MAX_PATH];
@@ -16,7 +89,7 @@ void run_remove(const char *exfs_path) {
     char *last_slash = strrchr(path_copy, '/');
     if (!last_slash || *(last_slash + 1) == '\0') {
         fprintf(stderr, "[remove] Invalid path: %s\n", exfs_path);
-        return;
+        return -1;
     }
 
     char *filename = last_slash + 1;
@@ -25,125 +98,57 @@ void run_remove(const char *exfs_path) {
     int parent_inode_num = find_inode_by_path(path_copy[0] ? path_copy : "/");
     if (parent_inode_num < 0) {
         fprintf(stderr, "[remove] Parent directory not found\n");
-        return;
+        return -1;
     }
 
-    int parent_seg, parent_off;
-    get_segment_and_inode_offset(parent_inode_num, &parent_seg, &parent_off);
-
-    Inode parent;
-    fseek(inode_segments[parent_seg], parent_off * sizeof(Inode), SEEK_SET);
-    fread(&parent, sizeof(Inode), 1, inode_segments[parent_seg]);
-
-    int blk_seg, blk_off;
-    get_segment_and_block_offset(parent.direct[0], &blk_seg, &blk_off);
-
-    char dir_block[BLOCK_SIZE];
-    fseek(data_segments[blk_seg], blk_off * BLOCK_SIZE, SEEK_SET);
-    fread(dir_block, BLOCK_SIZE, 1, data_segments[blk_seg]);
-
-    uint32_t offset = 0, found_offset = UINT32_MAX, target_inode_num = UINT32_MAX;
-
-    while (offset < BLOCK_SIZE) {
-        DirEntry *entry = (DirEntry *)(dir_block + offset);
-        if (entry->inode_num == 0 || entry->name_len == 0) break;
-
-        if (entry->name_len == strlen(filename) &&
-            strncmp(entry->name, filename, entry->name_len) == 0) {
-            target_inode_num = entry->inode_num;
-            found_offset = offset;
-            break;
-        }
-
-        offset += sizeof(uint32_t) + sizeof(uint8_t) + entry->name_len + 1;
-    }
-
-    if (target_inode_num == UINT32_MAX || found_offset == UINT32_MAX) {
+    int target_inode_num = dir_lookup(parent_inode_num, filename);
+    if (target_inode_num < 0) {
         fprintf(stderr, "[remove] File '%s' not found in parent dir\n", filename);
-        return;
+        return -1;
     }
 
-    // Remove directory entry
-    memset(dir_block + found_offset, 0, sizeof(DirEntry));
-    fseek(data_segments[blk_seg], blk_off * BLOCK_SIZE, SEEK_SET);
-    fwrite(dir_block, BLOCK_SIZE, 1, data_segments[blk_seg]);
-    fflush(data_segments[blk_seg]);
-
-    // Load and clear the file inode
-    int inode_seg, inode_off;
-    get_segment_and_inode_offset(target_inode_num, &inode_seg, &inode_off);
-
+    // Load the target inode; directories must be empty before they can go
     Inode file_inode;
-    fseek(inode_segments[inode_seg], inode_off * sizeof(Inode), SEEK_SET);
-    fread(&file_inode, sizeof(Inode), 1, inode_segments[inode_seg]);
-
-    char zero_block[BLOCK_SIZE] = {0};
-
-    // --- Direct blocks ---
-    for (uint32_t i = 0; i < DIRECT_BLOCKS; ++i) {
-        if (file_inode.direct[i] != 0) {
-            int seg, blk;
-            get_segment_and_block_offset(file_inode.direct[i], &seg, &blk);
-            fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-            fwrite(zero_block, BLOCK_SIZE, 1, data_segments[seg]);
+    read_inode(target_inode_num, &file_inode);
+
+    if (file_inode.type == TYPE_DIR) {
+        int entries = 0;
+        dir_foreach(target_inode_num, count_entry, &entries);
+        if (entries > 0) {
+            fprintf(stderr, "[remove] Directory '%s' is not empty\n", filename);
+            return -1;
         }
     }
 
-    // --- Single Indirect ---
-    if (file_inode.indirect_single != 0) {
-        uint32_t blocks[PTRS_PER_BLOCK] = {0};
-        extract_block_list(file_inode.indirect_single, blocks, PTRS_PER_BLOCK);
-
-        for (uint32_t i = 0; i < PTRS_PER_BLOCK; ++i) {
-            if (blocks[i] == 0) break;
-            int seg, blk;
-            get_segment_and_block_offset(blocks[i], &seg, &blk);
-            fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-            fwrite(zero_block, BLOCK_SIZE, 1, data_segments[seg]);
-        }
-
-        int seg, blk;
-        get_segment_and_block_offset(file_inode.indirect_single, &seg, &blk);
-        fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-        fwrite(zero_block, BLOCK_SIZE, 1, data_segments[seg]);
+    // Remove directory entry
+    dir_remove(parent_inode_num, filename);
+
+    if (file_inode.type == TYPE_DIR) {
+        dir_for_each_block(&file_inode, mark_block_free);
+        dcache_forget_dir(target_inode_num);
+        clear_inode(target_inode_num);
+        mark_inode_free(target_inode_num);
+        fprintf(stderr, "[remove] Directory '%s' removed successfully.\n", filename);
+        return 0;
     }
 
-    // --- Double Indirect ---
-    if (file_inode.indirect_double != 0) {
-        uint32_t dbl[PTRS_PER_BLOCK] = {0};
-        extract_block_list(file_inode.indirect_double, dbl, PTRS_PER_BLOCK);
-
-        for (uint32_t i = 0; i < PTRS_PER_BLOCK; ++i) {
-            if (dbl[i] == 0) break;
-
-            uint32_t inner[PTRS_PER_BLOCK] = {0};
-            extract_block_list(dbl[i], inner, PTRS_PER_BLOCK);
-
-            for (uint32_t j = 0; j < PTRS_PER_BLOCK; ++j) {
-                if (inner[j] == 0) break;
-                int seg, blk;
-                get_segment_and_block_offset(inner[j], &seg, &blk);
-                fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-                fwrite(zero_block, BLOCK_SIZE, 1, data_segments[seg]);
-            }
-
-            int seg, blk;
-            get_segment_and_block_offset(dbl[i], &seg, &blk);
-            fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-            fwrite(zero_block, BLOCK_SIZE, 1, data_segments[seg]);
-        }
-
-        int seg, blk;
-        get_segment_and_block_offset(file_inode.indirect_double, &seg, &blk);
-        fseek(data_segments[seg], blk * BLOCK_SIZE, SEEK_SET);
-        fwrite(zero_block, BLOCK_SIZE, 1, data_segments[seg]);
-    }
+    release_file_blocks(&file_inode);
 
     // Clear the inode itself
-    Inode empty = {0};
-    fseek(inode_segments[inode_seg], inode_off * sizeof(Inode), SEEK_SET);
-    fwrite(&empty, sizeof(Inode), 1, inode_segments[inode_seg]);
-    fflush(inode_segments[inode_seg]);
+    clear_inode(target_inode_num);
+    mark_inode_free(target_inode_num);
 
     fprintf(stderr, "[remove] File '%s' removed successfully.\n", filename);
+    return 0;
+}
+
+/**
+ * Remove a file or empty directory as one journal transaction.
+ * Returns 0 on success, -1 on failure.
+ */
+int run_remove(const char *exfs_path) {
+    journal_begin();
+    int status = remove_path(exfs_path);
+    journal_commit();
+    return status;
 }
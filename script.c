@@ -0,0 +1,136 @@
+// script.c
+// Batch mode: run a sequence of commands from a script file (or stdin)
+// against the filesystem mounted once by main(). Segment files, the block,
+// inode and dentry caches and the bitmaps stay loaded between commands, and
+// dirty data reaches the segment files once, when the filesystem is unmounted
+// at exit.
+//
+// One command per line; blank lines and lines starting with '#' are ignored:
+//   add <exfs_path> <host_path>
+//   extract <exfs_path> [host_path]     (stdout when no host path is given)
+//   remove <exfs_path>
+//   list
+//   debug <exfs_path>
+//   bulk <manifest>
+//   scrub
+//   trim
+// The last argument runs to the end of the line, so host paths may contain spaces.
+
+#include "exfs2.h"
+#include <errno.h>
+#include <fcntl.h>
+
+/**
+ * Extract a file into a host file instead of stdout. Returns 0 on success,
+ * -1 on failure.
+ */
+static int extract_to_file(const char *exfs_path, const char *host_path) {
+    int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[script] Cannot create '%s': %s\n", host_path, strerror(errno));
+        return -1;
+    }
+    output_set_fd(fd);
+    int status = run_extract(exfs_path);
+    output_set_fd(STDOUT_FILENO);
+    if (close(fd) != 0) {
+        fprintf(stderr, "[script] Cannot write '%s': %s\n", host_path, strerror(errno));
+        status = -1;
+    }
+    return status;
+}
+
+/**
+ * Split off the next whitespace-separated word of `*line`. With `rest` set,
+ * the word runs to the end of the line instead. Returns NULL if there is none.
+ */
+static char *next_arg(char **line, int rest) {
+    char *arg = *line + strspn(*line, " \t");
+    if (*arg == '\0') return NULL;
+
+    char *end = rest ? arg + strlen(arg) : arg + strcspn(arg, " \t");
+    *line = *end ? end + 1 : end;
+    if (rest) {
+        while (end > arg && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    }
+    *end = '\0';
+    return arg;
+}
+
+/**
+ * Run one script line. Returns 0 on success, 1 if the command failed and
+ * -1 for a malformed command.
+ */
+static int run_command(char *line) {
+    char *cmd = next_arg(&line, 0);
+    if (strcmp(cmd, "list") == 0) {
+        run_list(stdout);
+        return 0;
+    }
+    if (strcmp(cmd, "scrub") == 0) {
+        return run_scrub() > 0;
+    }
+    if (strcmp(cmd, "trim") == 0) {
+        run_trim();
+        return 0;
+    }
+
+    char *path = next_arg(&line, strcmp(cmd, "add") != 0 && strcmp(cmd, "extract") != 0);
+    if (!path) return -1;
+    char *host_path = next_arg(&line, 1);
+
+    int status = 0;
+    if (strcmp(cmd, "add") == 0 && host_path) {
+        status = run_add(path, host_path);
+    } else if (strcmp(cmd, "extract") == 0) {
+        status = host_path ? extract_to_file(path, host_path) : run_extract(path);
+    } else if (strcmp(cmd, "remove") == 0) {
+        status = run_remove(path);
+    } else if (strcmp(cmd, "debug") == 0) {
+        run_debug(path, stdout);
+    } else if (strcmp(cmd, "bulk") == 0) {
+        status = run_bulk_add(path);
+    } else {
+        return -1;
+    }
+    return status < 0;
+}
+
+/**
+ * Run every command in a script file ("-" reads stdin) against the mounted
+ * filesystem. Returns 0 if every command was valid and succeeded, -1 if the
+ * script cannot be opened or any command was malformed or failed.
+ */
+int run_script(const char *script_path) {
+    int from_stdin = strcmp(script_path, "-") == 0;
+    FILE *fp = from_stdin ? stdin : fopen(script_path, "r");
+    if (!fp) {
+        perror("[script] Failed to open script");
+        return -1;
+    }
+
+    char line[2 * MAX_PATH + 64];
+    int line_no = 0, commands = 0, errors = 0, failures = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *start = line + strspn(line, " \t");
+        if (*start == '\0' || *start == '#') continue;
+
+        char command[sizeof(line)];
+        strcpy(command, start);   // run_command splits the line in place
+        commands++;
+        int status = run_command(start);
+        if (status < 0) {
+            fprintf(stderr, "[script] Line %d: invalid command '%s'\n", line_no, command);
+            errors++;
+        } else if (status > 0) {
+            fprintf(stderr, "[script] Line %d: '%s' failed\n", line_no, command);
+            failures++;
+        }
+    }
+    if (!from_stdin) fclose(fp);
+
+    fprintf(stderr, "[script] Ran %d commands, %d invalid, %d failed\n", commands, errors, failures);
+    return errors || failures ? -1 : 0;
+}
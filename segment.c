@@ -0,0 +1,322 @@
+// segment.c
+// Segment file cache: segment files are opened on first access and at most
+// MAX_OPEN_SEGMENTS of them are kept open, closing the least recently used.
+// Segment I/O uses stdio by default; with EXFS2_IO=mmap each open segment is
+// memory mapped instead and segment_read/segment_write copy to and from the
+// mapping (EXFS2_MMAP_SYNC=1 makes flushes wait for msync). Accesses that
+// reach past the mapping go through the descriptor with pread/pwrite.
+// Every entry point holds segment_lock, so server threads can share the
+// cache; a descriptor or mapping returned by segment_fd/segment_ptr stays
+// valid only until another thread's access evicts that segment.
+// Data segments written since the last sync_data_segments() are remembered,
+// so the journal can force file data to disk before the records that use it.
+
+#include "exfs2.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SEG_INODE 0
+#define SEG_DATA  1
+
+typedef struct {
+    int kind;                   // SEG_INODE or SEG_DATA, -1 if the slot is empty
+    int index;                  // Segment number
+    FILE *fp;
+    uint8_t *map;               // Whole-segment mapping (mmap engine), or NULL
+    size_t map_len;             // Bytes mapped
+    unsigned long last_used;    // Access clock value for LRU eviction
+} OpenSegment;
+
+static OpenSegment open_segments[MAX_OPEN_SEGMENTS];
+static int16_t *segment_slot[2];                // Segment -> cache slot (or -1), grown on demand
+static int slots_tracked[2];
+static uint8_t *data_unsynced = NULL;           // Data segment -> written since the last sync
+static int unsynced_tracked = 0;
+static unsigned long access_clock = 0;
+static int cache_ready = 0;
+static int use_mmap = 0;        // Segment I/O engine: 0 = stdio, 1 = mmap
+static int mmap_sync = 0;       // msync(MS_SYNC) on flush instead of MS_ASYNC
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_segment_cache() {
+    for (int i = 0; i < MAX_OPEN_SEGMENTS; ++i) open_segments[i].kind = -1;
+
+    const char *engine = getenv("EXFS2_IO");
+    use_mmap = engine && strcmp(engine, "mmap") == 0;
+    mmap_sync = getenv("EXFS2_MMAP_SYNC") != NULL;
+    cache_ready = 1;
+}
+
+/**
+ * Name of the segment I/O engine in use ("stdio" or "mmap").
+ */
+const char *segment_io_engine() {
+    pthread_mutex_lock(&segment_lock);
+    if (!cache_ready) init_segment_cache();
+    pthread_mutex_unlock(&segment_lock);
+    return use_mmap ? "mmap" : "stdio";
+}
+
+/**
+ * Close one cached segment, syncing and unmapping it first.
+ */
+static void close_slot(OpenSegment *entry) {
+    if (entry->map) {
+        msync(entry->map, entry->map_len, mmap_sync ? MS_SYNC : MS_ASYNC);
+        munmap(entry->map, entry->map_len);
+        entry->map = NULL;
+    }
+    fclose(entry->fp);
+    segment_slot[entry->kind][entry->index] = -1;
+    entry->kind = -1;
+}
+
+/**
+ * Build the on-disk file name of a segment.
+ */
+void segment_filename(int is_data, int index, char *out, size_t out_len) {
+    snprintf(out, out_len, is_data ? "data_segment_%d.seg" : "inode_segment_%d.seg", index);
+}
+
+/**
+ * Grow the segment -> slot table of one kind to cover segment `index`.
+ */
+static void track_segment_slots(int kind, int index) {
+    if (index < slots_tracked[kind]) return;
+
+    int capacity = slots_tracked[kind] ? slots_tracked[kind] : 1024;
+    while (capacity <= index) capacity *= 2;
+    segment_slot[kind] = realloc(segment_slot[kind], (size_t)capacity * sizeof(int16_t));
+    if (!segment_slot[kind]) {
+        fprintf(stderr, "[segment] Out of memory for segment table\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(segment_slot[kind] + slots_tracked[kind], 0xff, (size_t)(capacity - slots_tracked[kind]) * sizeof(int16_t));
+    slots_tracked[kind] = capacity;
+}
+
+/**
+ * Remember that data segment `index` has writes that may not be on disk.
+ * Called with segment_lock held.
+ */
+static void mark_unsynced(int index) {
+    if (index >= unsynced_tracked) {
+        int capacity = unsynced_tracked ? unsynced_tracked : 1024;
+        while (capacity <= index) capacity *= 2;
+        data_unsynced = realloc(data_unsynced, (size_t)capacity);
+        if (!data_unsynced) {
+            fprintf(stderr, "[segment] Out of memory for segment table\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(data_unsynced + unsynced_tracked, 0, (size_t)(capacity - unsynced_tracked));
+        unsynced_tracked = capacity;
+    }
+    data_unsynced[index] = 1;
+}
+
+/**
+ * Note a data segment written through a descriptor of its own (bulk add),
+ * so the next sync_data_segments() covers it.
+ */
+void segment_mark_unsynced(int index) {
+    pthread_mutex_lock(&segment_lock);
+    mark_unsynced(index);
+    pthread_mutex_unlock(&segment_lock);
+}
+
+/**
+ * Return the cache entry for a segment, opening it (and evicting the least
+ * recently used segment if the cache is full) when needed.
+ */
+static OpenSegment *open_segment(int kind, int index) {
+    if (!cache_ready) init_segment_cache();
+    track_segment_slots(kind, index);
+
+    int slot = segment_slot[kind][index];
+    if (slot >= 0) {
+        open_segments[slot].last_used = ++access_clock;
+        return &open_segments[slot];
+    }
+
+    // Pick an empty slot, or the least recently used one
+    slot = 0;
+    for (int i = 0; i < MAX_OPEN_SEGMENTS; ++i) {
+        if (open_segments[i].kind < 0) {
+            slot = i;
+            break;
+        }
+        if (open_segments[i].last_used < open_segments[slot].last_used) slot = i;
+    }
+
+    OpenSegment *entry = &open_segments[slot];
+    if (entry->kind >= 0) close_slot(entry);
+
+    char filename[64];
+    segment_filename(kind == SEG_DATA, index, filename, sizeof(filename));
+    FILE *fp = fopen(filename, "r+b");
+    if (!fp) {
+        fprintf(stderr, "[segment] Failed to open %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    entry->map = NULL;
+    if (use_mmap) {
+        // Map the whole segment, growing files that predate its full size
+        // (touching a mapped page past the end of the file raises SIGBUS)
+        size_t len = kind == SEG_INODE ? inode_segment_size : SEGMENT_SIZE;
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fileno(fp), &st) == 0 && ((size_t)st.st_size >= len || ftruncate(fileno(fp), (off_t)len) == 0)) {
+            map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+        }
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "[segment] mmap of %s failed, using stdio\n", filename);
+        } else {
+            entry->map = map;
+            entry->map_len = len;
+        }
+    }
+
+    entry->kind = kind;
+    entry->index = index;
+    entry->fp = fp;
+    entry->last_used = ++access_clock;
+    segment_slot[kind][index] = slot;
+    return entry;
+}
+
+static OpenSegment *checked_segment(int is_data, int index) {
+    int count = is_data ? num_data_segments : num_inode_segments;
+    if (index < 0 || index >= count) {
+        fprintf(stderr, "[segment] Invalid %s segment %d (max %d)\n", is_data ? "data" : "inode", index, count - 1);
+        exit(EXIT_FAILURE);
+    }
+    return open_segment(is_data ? SEG_DATA : SEG_INODE, index);
+}
+
+/**
+ * Whether `len` bytes at `offset` lie inside the segment's mapping.
+ */
+static int mapped(const OpenSegment *entry, size_t offset, size_t len) {
+    return entry->map && offset <= entry->map_len && len <= entry->map_len - offset;
+}
+
+/**
+ * Read `len` bytes at `offset` in a segment. Bytes past the end of the
+ * file read as zero. Returns the number of bytes actually stored on disk.
+ */
+size_t segment_read(int is_data, int index, size_t offset, void *buf, size_t len) {
+    pthread_mutex_lock(&segment_lock);
+    OpenSegment *entry = checked_segment(is_data, index);
+    size_t got = len;
+    if (mapped(entry, offset, len)) {
+        memcpy(buf, entry->map + offset, len);
+    } else if (entry->map) {
+        ssize_t n = pread(fileno(entry->fp), buf, len, (off_t)offset);
+        got = n > 0 ? (size_t)n : 0;
+        if (got < len) memset((uint8_t *)buf + got, 0, len - got);
+    } else {
+        fseek(entry->fp, (long)offset, SEEK_SET);
+        got = fread(buf, 1, len, entry->fp);
+        if (got < len) memset((uint8_t *)buf + got, 0, len - got);
+    }
+    pthread_mutex_unlock(&segment_lock);
+    return got;
+}
+
+/**
+ * Write `len` bytes at `offset` in a segment.
+ */
+void segment_write(int is_data, int index, size_t offset, const void *buf, size_t len) {
+    pthread_mutex_lock(&segment_lock);
+    OpenSegment *entry = checked_segment(is_data, index);
+    if (mapped(entry, offset, len)) {
+        memcpy(entry->map + offset, buf, len);
+    } else if (entry->map) {
+        if (pwrite(fileno(entry->fp), buf, len, (off_t)offset) != (ssize_t)len) {
+            perror("[segment] Write past the mapping failed");
+        }
+    } else {
+        fseek(entry->fp, (long)offset, SEEK_SET);
+        fwrite(buf, 1, len, entry->fp);
+    }
+    if (is_data) mark_unsynced(index);
+    pthread_mutex_unlock(&segment_lock);
+}
+
+/**
+ * Force every data segment written since the last call to disk (msync or
+ * fflush, then fdatasync). Segments evicted from the cache meanwhile are
+ * reopened: their pages are still dirty in the kernel.
+ */
+void sync_data_segments() {
+    pthread_mutex_lock(&segment_lock);
+    for (int i = 0; i < unsynced_tracked && i < num_data_segments; ++i) {
+        if (!data_unsynced[i]) continue;
+        OpenSegment *entry = checked_segment(1, i);
+        if (entry->map) msync(entry->map, entry->map_len, MS_SYNC);
+        else fflush(entry->fp);
+        if (fdatasync(fileno(entry->fp)) != 0) perror("[segment] fdatasync failed");
+        data_unsynced[i] = 0;
+    }
+    pthread_mutex_unlock(&segment_lock);
+}
+
+/**
+ * Return the file descriptor of a segment for kernel-side copies. Buffered
+ * stdio writes are flushed first so the descriptor sees them.
+ */
+int segment_fd(int is_data, int index) {
+    pthread_mutex_lock(&segment_lock);
+    OpenSegment *entry = checked_segment(is_data, index);
+    if (!entry->map) fflush(entry->fp);
+    int fd = fileno(entry->fp);
+    pthread_mutex_unlock(&segment_lock);
+    return fd;
+}
+
+/**
+ * Return a pointer straight into the mapping of a segment, hinting the
+ * kernel to read the range ahead. Returns NULL with the stdio engine, or if
+ * the range is not entirely mapped. The pointer is only valid until the next
+ * segment access.
+ */
+const uint8_t *segment_ptr(int is_data, int index, size_t offset, size_t len) {
+    pthread_mutex_lock(&segment_lock);
+    OpenSegment *entry = checked_segment(is_data, index);
+    const uint8_t *ptr = NULL;
+    if (mapped(entry, offset, len)) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = offset & ~(page - 1);
+        madvise(entry->map + start, offset + len - start, MADV_WILLNEED);
+        ptr = entry->map + offset;
+    }
+    pthread_mutex_unlock(&segment_lock);
+    return ptr;
+}
+
+/**
+ * Flush every open segment without closing it (msync for mapped segments).
+ */
+void flush_all_segments() {
+    pthread_mutex_lock(&segment_lock);
+    for (int i = 0; cache_ready && i < MAX_OPEN_SEGMENTS; ++i) {
+        OpenSegment *entry = &open_segments[i];
+        if (entry->kind < 0) continue;
+        if (entry->map) msync(entry->map, entry->map_len, mmap_sync ? MS_SYNC : MS_ASYNC);
+        else fflush(entry->fp);
+    }
+    pthread_mutex_unlock(&segment_lock);
+}
+
+/**
+ * Flush and close every cached segment file.
+ */
+void close_all_segments() {
+    pthread_mutex_lock(&segment_lock);
+    for (int i = 0; cache_ready && i < MAX_OPEN_SEGMENTS; ++i) {
+        if (open_segments[i].kind >= 0) close_slot(&open_segments[i]);
+    }
+    pthread_mutex_unlock(&segment_lock);
+}
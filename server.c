@@ -0,0 +1,343 @@
+// server.c
+// Server mode: keep the filesystem mounted and serve requests from local
+// clients over a Unix domain socket, one thread per connection. Requests that
+// only read (extract, list, stat) share fs_lock and run concurrently; add and
+// remove take it exclusively and flush the block cache before releasing it,
+// so readers can read segment files through private descriptors. An add body
+// is received into an unlinked spool file before the lock is taken, so a slow
+// client never holds up the others. Writers
+// wait for their journal record to be durable outside the lock, so writers
+// that arrive together share one sync.
+//
+// Protocol (one request per connection):
+//   request:  "<command> [exfs_path]\n" (separated by a tab or spaces),
+//             extract may add "\t<offset>\t<length>" to read a byte range,
+//             followed for add by the file contents until the client shuts
+//             down its side of the socket
+//   response: "OK [size]\n" and the payload (extract data, list or stat text),
+//             or "ERR <reason>\n"
+// The client mode (-C) sends one request and copies the payload to stdout.
+
+#define _GNU_SOURCE
+#include "exfs2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CLIENT_BUFFER_SIZE (64 * 1024)
+
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile sig_atomic_t stop_server = 0;
+
+/**
+ * Fill in a socket address for `socket_path`. Returns -1 if the path is too long.
+ */
+static int socket_address(const char *socket_path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "[server] Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+/**
+ * Resolve `exfs_path` to a regular file inode for extract. Returns -1 if it is
+ * missing or not a file.
+ */
+static int find_file(const char *exfs_path, Inode *inode) {
+    int inode_num = find_inode_by_path(exfs_path);
+    if (inode_num < 0) return -1;
+    read_inode(inode_num, inode);
+    return inode->type == TYPE_FILE ? inode_num : -1;
+}
+
+/**
+ * Receive the rest of the request stream (an add body) into an unlinked spool
+ * file next to the segment files. Returns the spool rewound to its start, or
+ * NULL if the body could not be received.
+ */
+static FILE *spool_body(FILE *in) {
+    int fd = open(".", O_TMPFILE | O_RDWR, 0600);
+    FILE *spool = fd >= 0 ? fdopen(fd, "w+b") : tmpfile();   // tmpfile() where O_TMPFILE is unsupported
+    if (!spool) {
+        perror("[server] Cannot create spool file");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    char buf[CLIENT_BUFFER_SIZE];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, spool) != n) break;
+    }
+    if (ferror(in) || ferror(spool) || fflush(spool) != 0) {
+        fprintf(stderr, "[server] Failed to receive the add body\n");
+        fclose(spool);
+        return NULL;
+    }
+    rewind(spool);
+    return spool;
+}
+
+/**
+ * Run one request. `in` holds the rest of the request stream (add data),
+ * `out` carries the response; extract data bypasses it and goes straight to `fd`.
+ * A non-NULL `range` ("<offset>\t<length>") limits extract to that byte range.
+ */
+static void handle_request(int fd, FILE *in, FILE *out, const char *cmd, const char *path, const char *range) {
+    if (strcmp(cmd, "list") == 0) {
+        pthread_rwlock_rdlock(&fs_lock);
+        fprintf(out, "OK\n");
+        run_list(out);
+        pthread_rwlock_unlock(&fs_lock);
+    } else if (!path) {
+        fprintf(out, "ERR missing path\n");
+    } else if (strcmp(cmd, "extract") == 0) {
+        pthread_rwlock_rdlock(&fs_lock);
+        Inode inode;
+        int found = find_file(path, &inode);
+        unsigned long long offset = 0, length = 0, size = found < 0 ? 0 : inode_file_size(&inode);
+        if (found < 0) {
+            fprintf(out, "ERR '%s' is not a file\n", path);
+        } else if (range && (sscanf(range, "%llu\t%llu", &offset, &length) != 2 || offset >= size)) {
+            fprintf(out, "ERR bad range '%s' for a %llu-byte file\n", range, size);
+        } else if (range) {
+            fprintf(out, "OK %llu\n", length < size - offset ? length : size - offset);
+            fflush(out);
+            output_set_fd(fd);
+            if (run_extract_range(path, offset, length) < 0) fprintf(stderr, "[server] Extract of '%s' cut short\n", path);
+        } else {
+            fprintf(out, "OK %llu\n", size);
+            fflush(out);
+            output_set_fd(fd);
+            if (run_extract(path) < 0) fprintf(stderr, "[server] Extract of '%s' cut short\n", path);
+        }
+        pthread_rwlock_unlock(&fs_lock);
+    } else if (strcmp(cmd, "stat") == 0) {
+        pthread_rwlock_rdlock(&fs_lock);
+        if (find_inode_by_path(path) < 0) {
+            fprintf(out, "ERR '%s' not found\n", path);
+        } else {
+            fprintf(out, "OK\n");
+            run_debug(path, out);
+        }
+        pthread_rwlock_unlock(&fs_lock);
+    } else if (strcmp(cmd, "add") == 0 || strcmp(cmd, "remove") == 0) {
+        FILE *spool = cmd[0] == 'a' ? spool_body(in) : NULL;   // Before the lock: the client sets the pace
+        if (cmd[0] == 'a' && !spool) {
+            fprintf(out, "ERR add '%s' failed: body not received\n", path);
+            return;
+        }
+
+        pthread_rwlock_wrlock(&fs_lock);
+        journal_begin();
+        int status = spool ? run_add_stream(path, spool) : run_remove(path);
+        uint64_t seq = journal_commit();
+        bcache_flush();   // Readers see segment files through their own descriptors
+        pthread_rwlock_unlock(&fs_lock);
+        if (spool) fclose(spool);
+        journal_sync(seq);   // Shared with writers that committed meanwhile
+        if (status == 0) fprintf(out, "OK\n");
+        else fprintf(out, "ERR %s '%s' failed\n", cmd, path);
+    } else {
+        fprintf(out, "ERR unknown command '%s'\n", cmd);
+    }
+}
+
+/**
+ * Connection thread: read one request line, run it and close the connection.
+ */
+static void *client_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    output_use_private_fds();
+
+    FILE *in = fdopen(fd, "r");
+    int out_fd = dup(fd);
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    char line[MAX_PATH + 32];
+    if (in && out && fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *save = NULL;
+        char *cmd = strtok_r(line, " \t", &save);
+        char *path = strtok_r(NULL, "\t", &save);   // Paths may contain spaces
+        char *range = strtok_r(NULL, "", &save);
+        if (path) path += strspn(path, " ");
+        if (cmd) handle_request(fd, in, out, cmd, path && *path ? path : NULL, range);
+    }
+
+    if (out) fclose(out);
+    else if (out_fd >= 0) close(out_fd);
+    if (in) fclose(in);
+    else close(fd);
+    output_release();
+    return NULL;
+}
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_server = 1;
+}
+
+/**
+ * Serve clients on `socket_path` until SIGINT or SIGTERM. In-flight requests
+ * finish before the filesystem is unmounted.
+ */
+void run_server(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (socket_address(socket_path, &addr) < 0) return;
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("[server] socket");
+        return;
+    }
+
+    // A socket file nobody accepts on is left over from an earlier server
+    if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "[server] A server is already listening on %s\n", socket_path);
+        close(listen_fd);
+        return;
+    }
+    close(listen_fd);
+    unlink(socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+        perror("[server] Failed to listen");
+        if (listen_fd >= 0) close(listen_fd);
+        return;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;   // No SA_RESTART: accept() returns EINTR
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);       // A client hanging up must not kill the server
+
+    bcache_flush();   // Connection threads read segment files directly
+    fprintf(stderr, "[server] Listening on %s\n", socket_path);
+
+    unsigned long served = 0;
+    while (!stop_server) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) perror("[server] accept");
+            continue;
+        }
+
+        // Connection threads inherit a mask that leaves SIGINT/SIGTERM to this thread
+        sigset_t stop_signals, old_mask;
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, client_thread, (void *)(intptr_t)fd) != 0) {
+            fprintf(stderr, "[server] Failed to start connection thread\n");
+            close(fd);
+        } else {
+            served++;
+        }
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    // Wait for in-flight requests, then keep others out while unmounting
+    pthread_rwlock_wrlock(&fs_lock);
+    fprintf(stderr, "[server] Stopped after %lu connections\n", served);
+}
+
+/**
+ * Write all of `buf` to `fd`. Returns -1 on error.
+ */
+static int write_full(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Client mode: send one request (`args`: command, then its arguments) to the
+ * server on `socket_path` (add reads the file contents from stdin) and copy
+ * the response payload to stdout. Returns the process exit status.
+ */
+int run_client(const char *socket_path, char **args, int count) {
+    struct sockaddr_un addr;
+    if (socket_address(socket_path, &addr) < 0) return EXIT_FAILURE;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "[client] Cannot connect to %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    uint8_t *buf = malloc(CLIENT_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "[client] Out of memory\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    // --- Request line (arguments separated by tabs), then file contents for add ---
+    int len = 0;
+    for (int i = 0; i < count && len < CLIENT_BUFFER_SIZE; ++i) {
+        len += snprintf((char *)buf + len, CLIENT_BUFFER_SIZE - len, "%s%s", i ? "\t" : "", args[i]);
+    }
+    len += snprintf((char *)buf + len, CLIENT_BUFFER_SIZE - len, "\n");
+    int failed = len >= CLIENT_BUFFER_SIZE || write_full(fd, buf, len) < 0;
+    if (!failed && strcmp(args[0], "add") == 0) {
+        ssize_t n;
+        while (!failed && (n = read(STDIN_FILENO, buf, CLIENT_BUFFER_SIZE)) > 0) failed = write_full(fd, buf, n) < 0;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // --- Status line ---
+    char status[MAX_PATH + 64];
+    size_t used = 0;
+    while (used < sizeof(status) - 1 && read(fd, status + used, 1) == 1 && status[used] != '\n') used++;
+    status[used] = '\0';
+    if (strncmp(status, "OK", 2) != 0) {
+        fprintf(stderr, "[client] %s\n", used ? status : "No response from server");
+        free(buf);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    // --- Payload ---
+    unsigned long long expected = 0, received = 0;
+    int sized = sscanf(status, "OK %llu", &expected) == 1;
+    ssize_t n;
+    while ((n = read(fd, buf, CLIENT_BUFFER_SIZE)) > 0) {
+        if (write_full(STDOUT_FILENO, buf, n) < 0) break;
+        received += n;
+    }
+    free(buf);
+    close(fd);
+
+    if (sized && received != expected) {
+        fprintf(stderr, "[client] Short transfer: %llu of %llu bytes\n", received, expected);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
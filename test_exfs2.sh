@@ -3,9 +3,9 @@
 set -e  # Exit on any error
 
 echo "[init] Cleaning old segment and temp files..."
-rm -f inode_segment_*.seg data_segment_*.seg exfs2 *.o \
+rm -f inode_segment_*.seg data_segment_*.seg block_bitmap.seg inode_bitmap.seg superblock.seg journal.seg dedup.seg checksums.seg exfs2 *.o \
       hello.txt recovered.txt bigfile.bin recovered_big.bin \
-      huge.bin recovered_huge.bin
+      huge.bin recovered_huge.bin giant.bin recovered_giant.bin manifest.txt log.txt
 
 echo "[build] Compiling filesystem..."
 make clean && make
@@ -17,7 +17,8 @@ if [[ ! -x ./exfs2 ]]; then
 fi
 
 echo "[init] Initializing filesystem..."
-./exfs2 -l || true
+./exfs2 -i 256
+./exfs2 -l
 
 # === Small file test ===
 echo "[test] Creating hello.txt..."
@@ -32,6 +33,27 @@ echo "[test] Removing hello.txt..."
 ./exfs2 -r /greeting/hello.txt
 ./exfs2 -l
 
+# === Large directory test (hashed buckets, removal from the middle, a second index level, emptied buckets freed) ===
+echo "[test] Adding 300 files to /many..."
+echo "entry" > hello.txt
+for i in $(seq 1 300); do
+  ./exfs2 -a /many/f$i -f hello.txt 2>/dev/null
+done
+./exfs2 -r /many/f150
+./exfs2 -e /many/f151 > recovered.txt
+diff hello.txt recovered.txt
+echo "[test] Bulk adding 20000 files to /wide, then removing them..."
+used_blocks() { od -An -tu4 -j20 -N8 superblock.seg | awk '{ print $1 * 255 - $2 }'; }   # Block 0 of each segment is reserved
+used_before=$(used_blocks)
+for i in $(seq 1 20000); do echo "/wide/f$i hello.txt"; done > manifest.txt
+./exfs2 -b manifest.txt 2>/dev/null
+./exfs2 -e /wide/f12345 2>/dev/null | diff hello.txt -
+[[ $(./exfs2 -D /wide | sed -n 's/.*, \([0-9]*\) buckets.*/\1/p') -gt 1020 ]]
+[[ $(./exfs2 -l 2>/dev/null | grep -c "|- f") -eq 20299 ]]
+sed 's/^\([^ ]*\) .*/remove \1/' manifest.txt | ./exfs2 -s - 2>/dev/null
+[[ $(./exfs2 -l 2>/dev/null | grep -c "|- f") -eq 299 ]] && [[ $(used_blocks) -eq $((used_before + 1)) ]] &&
+  echo "✅ Large directory test passed"
+
 # === Medium file test (~1MB) ===
 echo "[test] Creating 1MB bigfile.bin..."
 dd if=/dev/urandom of=bigfile.bin bs=1M count=1 status=none
@@ -44,7 +66,7 @@ echo "[test] Extracting bigfile.bin..."
 ./exfs2 -e /deep/big.bin > recovered_big.bin
 cmp bigfile.bin recovered_big.bin && echo "✅ Medium file test passed"
 
-# === Large file test (~5MB, triggers double indirect) ===
+# === Large file test (~5MB, stored as a handful of extents; extract to a full disk fails) ===
 echo "[test] Creating 5MB huge.bin..."
 dd if=/dev/urandom of=huge.bin bs=1M count=5 status=none
 
@@ -54,11 +76,215 @@ echo "[test] Adding huge.bin..."
 
 echo "[test] Extracting huge.bin..."
 ./exfs2 -e /vault/huge.bin > recovered_huge.bin
-cmp huge.bin recovered_huge.bin && echo "✅ Large file test (double indirect) passed"
+./exfs2 -e /vault/huge.bin > /dev/full && { echo "[error] extract to a full disk reported success"; exit 1; }
+cmp huge.bin recovered_huge.bin && echo "✅ Large file test (extents) passed"
+
+# === Giant file test (~70MB, too many runs for inline extents -> double indirect) ===
+echo "[test] Creating 70MB giant.bin..."
+dd if=/dev/urandom of=giant.bin bs=1M count=70 status=none
+
+echo "[test] Adding giant.bin..."
+./exfs2 -a /vault/giant.bin -f giant.bin
+
+echo "[test] Extracting giant.bin..."
+./exfs2 -e /vault/giant.bin > recovered_giant.bin
+cmp giant.bin recovered_giant.bin && echo "✅ Giant file test (double indirect) passed"
+
+# === Ranged extract test (last 4KB and a mid-file slice, unaligned) ===
+echo "[test] Extracting byte ranges of giant.bin..."
+./exfs2 -e /vault/giant.bin 73396224 4096 > recovered_giant.bin
+tail -c 4096 giant.bin | cmp - recovered_giant.bin
+./exfs2 -e /vault/giant.bin 1234567 3000000 > recovered_giant.bin
+tail -c +1234568 giant.bin | head -c 3000000 | cmp - recovered_giant.bin && echo "✅ Ranged extract test passed"
+
+# === Stream input test (stdin through a pipe; failed adds leave nothing allocated) ===
+echo "[test] Adding from a pipe, from an unreadable input and under an invalid name..."
+cat huge.bin | ./exfs2 -a /piped/huge.bin -f -
+./exfs2 -e /piped/huge.bin > recovered_huge.bin
+used_before=$(used_blocks)
+./exfs2 -a /piped/dir.bin -f . && { echo "[error] add of an unreadable input succeeded"; exit 1; }
+./exfs2 -e /piped/dir.bin > recovered.txt && { echo "[error] failed add left a file behind"; exit 1; }
+./exfs2 -a /piped/$(printf 'n%.0s' {1..300}) -f huge.bin && { echo "[error] add under a 300-byte name succeeded"; exit 1; }
+cmp huge.bin recovered_huge.bin && [[ $(used_blocks) -eq $used_before ]] && echo "✅ Stream input test passed"
+
+# === Bulk add test (manifest, worker threads) ===
+echo "[test] Bulk adding from manifest..."
+printf '/bulk/hello.txt hello.txt\n/bulk/big.bin bigfile.bin\n/bulk/sub/giant.bin giant.bin\n' > manifest.txt
+EXFS2_INGEST_THREADS=3 ./exfs2 -b manifest.txt
+./exfs2 -e /bulk/sub/giant.bin > recovered_giant.bin
+./exfs2 -e /bulk/big.bin > recovered_big.bin
+cmp giant.bin recovered_giant.bin && cmp bigfile.bin recovered_big.bin && echo "✅ Bulk add test passed"
+
+# === Script test (several commands in one process) ===
+echo "[test] Running a command script..."
+rm -f recovered_big.bin recovered.txt
+printf 'add /script/big.bin bigfile.bin\nextract /script/big.bin recovered_big.bin\nremove /bulk/hello.txt\nextract /bulk/hello.txt recovered.txt\n' |
+  ./exfs2 -s - && { echo "[error] script with a failed command exited 0"; exit 1; }
+./exfs2 -s missing_script.txt && { echo "[error] missing script exited 0"; exit 1; }
+cmp bigfile.bin recovered_big.bin && [[ ! -s recovered.txt ]] && echo "✅ Script test passed"
+
+# === Server test (Unix socket, concurrent clients; a stalled upload or a bad request harms nobody) ===
+echo "[test] Serving over a Unix socket..."
+./exfs2 -S exfs2_test.sock &
+server_pid=$!
+for _ in $(seq 1 100); do ./exfs2 -C exfs2_test.sock list >/dev/null 2>&1 && break; sleep 0.1; done
+{ sleep 4; cat hello.txt; } | ./exfs2 -C exfs2_test.sock add /served/slow.txt &
+slow_pid=$!
+sleep 0.2
+timeout 3 ./exfs2 -C exfs2_test.sock add /served/big.bin < bigfile.bin
+timeout 3 ./exfs2 -C exfs2_test.sock extract /served/big.bin > recovered_big.bin &
+client_pid=$!
+timeout 3 ./exfs2 -C exfs2_test.sock extract /vault/giant.bin > recovered_giant.bin
+wait $client_pid
+wait $slow_pid
+./exfs2 -C exfs2_test.sock add /served/big.bin/x < hello.txt && { echo "[error] add under a file succeeded"; exit 1; }
+./exfs2 -C exfs2_test.sock add /$(printf 'd%.0s' {1..300})/x < hello.txt && { echo "[error] add under a 300-byte name succeeded"; exit 1; }
+./exfs2 -C exfs2_test.sock extract /served/slow.txt > recovered.txt
+kill $server_pid
+wait $server_pid
+cmp bigfile.bin recovered_big.bin && cmp giant.bin recovered_giant.bin && cmp hello.txt recovered.txt &&
+  echo "✅ Server test passed"
+
+# === Journal recovery test (server killed after acknowledged writes) ===
+echo "[test] Killing a server after acknowledged writes..."
+./exfs2 -S exfs2_test.sock &
+server_pid=$!
+for _ in $(seq 1 100); do ./exfs2 -C exfs2_test.sock list >/dev/null 2>&1 && break; sleep 0.1; done
+./exfs2 -C exfs2_test.sock add /journal/huge.bin < huge.bin
+./exfs2 -C exfs2_test.sock remove /served/big.bin
+kill -9 $server_pid
+wait $server_pid 2>/dev/null || true
+rm -f exfs2_test.sock recovered_huge.bin recovered_big.bin
+./exfs2 -e /journal/huge.bin > recovered_huge.bin
+./exfs2 -e /served/big.bin > recovered_big.bin && { echo "[error] removed file still extracts"; exit 1; }
+cmp huge.bin recovered_huge.bin && [[ ! -s recovered_big.bin ]] && [[ ! -s journal.seg ]] &&
+  echo "✅ Journal recovery test passed"
+
+# === Crash before checkpoint test (file data is on disk before the record that refers to it) ===
+echo "[test] Crashing an add after its journal record is durable..."
+EXFS2_CRASH_BEFORE_CHECKPOINT=1 ./exfs2 -a /crash/huge.bin -f huge.bin || true
+[[ -s journal.seg ]]
+./exfs2 -e /crash/huge.bin > recovered_huge.bin
+cmp huge.bin recovered_huge.bin && [[ ! -s journal.seg ]] && echo "✅ Crash before checkpoint test passed"
+
+# === Freed block reuse test (blocks of a removed file are not reused before the remove is durable) ===
+echo "[test] Crashing a script that reuses the space of a file it removed..."
+rm -rf held && mkdir held
+head -c 800000 bigfile.bin > held/a.bin
+tail -c 800000 bigfile.bin > held/b.bin
+(
+  cd held
+  ../exfs2 -a /held/a.bin -f a.bin 2>/dev/null
+  ( printf 'remove /held/a.bin\nadd /held/b.bin b.bin\n'; sleep 2 ) | EXFS2_IO=mmap ../exfs2 -s - 2>/dev/null &
+  sleep 1
+  kill -9 $! 2>/dev/null || true
+  wait
+  # Either the remove was replayed, or a.bin must still hold its own data
+  if ../exfs2 -l 2>/dev/null | grep -q "|- a.bin"; then ../exfs2 -e /held/a.bin 2>/dev/null | cmp - a.bin; fi
+)
+rm -rf held
+echo "✅ Freed block reuse test passed"
+
+# === Dedup test (identical file stored once, shared blocks survive a remove) ===
+echo "[test] Adding the same file twice with dedup..."
+./exfs2 -a /dedup/hello.txt -f hello.txt   # Inline: creates the directory, no data blocks
+used_before=$(used_blocks)
+EXFS2_DEDUP=1 ./exfs2 -a /dedup/a.bin -f huge.bin
+used_once=$(used_blocks)
+EXFS2_DEDUP=1 ./exfs2 -a /dedup/b.bin -f huge.bin
+[[ $(used_blocks) -eq $used_once ]]
+./exfs2 -r /dedup/a.bin
+./exfs2 -e /dedup/b.bin > recovered_huge.bin
+./exfs2 -r /dedup/b.bin
+cmp huge.bin recovered_huge.bin && [[ $(used_blocks) -eq $used_before ]] && echo "✅ Dedup test passed"
+
+# === Compression test (text stored in fewer blocks, whole and ranged extract) ===
+echo "[test] Adding a text file compressed..."
+seq -f '2026-10-16 12:00:00 INFO worker 7 served request %g in 3 ms' 1 60000 > log.txt
+used_before=$(used_blocks)
+EXFS2_COMPRESS=1 ./exfs2 -a /compressed/log.txt -f log.txt
+[[ $(( $(used_blocks) - used_before )) -lt $(( $(stat -c %s log.txt) / 4096 / 2 )) ]]
+./exfs2 -e /compressed/log.txt > recovered.txt
+cmp log.txt recovered.txt
+./exfs2 -e /compressed/log.txt 100000 200000 > recovered.txt
+tail -c +100001 log.txt | head -c 200000 | cmp - recovered.txt && echo "✅ Compression test passed"
+
+# === Checksum test (scrub is clean, then catches a flipped byte that also fails extract) ===
+echo "[test] Scrubbing, then corrupting one data block..."
+./exfs2 -V
+./exfs2 -a /checked/big.bin -f bigfile.bin
+block=$(./exfs2 -D /checked/big.bin | sed -n 's/.*-> Blocks \([0-9]*\)-.*/\1/p' | head -n 1)
+segment=data_segment_$((block / 256)).seg offset=$(( (block % 256) * 4096 + 7 ))
+byte=$(od -An -tu1 -j $offset -N1 $segment)
+printf "\\x$(printf %02x $(( 255 - byte )))" | dd of=$segment bs=1 seek=$offset conv=notrunc 2>/dev/null
+./exfs2 -V && { echo "[error] scrub missed the corrupt block"; exit 1; }
+./exfs2 -e /checked/big.bin > recovered_big.bin 2> recovered.txt && { echo "[error] extract sent a corrupt block"; exit 1; }
+grep -q "Block $block is corrupt" recovered.txt
+./exfs2 -r /checked/big.bin
+./exfs2 -V && echo "✅ Checksum test passed"
+
+# === Sparse file test (zero blocks stored as holes, with extents and with block pointers) ===
+echo "[test] Adding files with long runs of zeros..."
+{ head -c 3000000 /dev/zero; head -c 100000 huge.bin; head -c 5000000 /dev/zero; } > sparse.bin
+{ for _ in $(seq 1 40); do head -c 4096 huge.bin; head -c 8192 /dev/zero; done; head -c 20000000 /dev/zero; head -c 5000 huge.bin; } > holes.bin
+used_before=$(used_blocks)
+./exfs2 -a /sparse/sparse.bin -f sparse.bin
+./exfs2 -a /sparse/holes.bin -f holes.bin
+[[ $(( $(used_blocks) - used_before )) -lt 100 ]]
+./exfs2 -e /sparse/sparse.bin | cmp - sparse.bin
+./exfs2 -e /sparse/holes.bin | cmp - holes.bin
+./exfs2 -e /sparse/sparse.bin 2990000 200000 > recovered.txt
+tail -c +2990001 sparse.bin | head -c 200000 | cmp - recovered.txt
+./exfs2 -e /sparse/holes.bin 480000 19600000 > recovered.txt
+tail -c +480001 holes.bin | head -c 19600000 | cmp - recovered.txt && echo "✅ Sparse file test passed"
+
+# === Reclaim test (remove punches the freed blocks out of the segment files, reuse still reads right) ===
+echo "[test] Removing a file and checking the segment files shrink..."
+disk_kb() { du -kc data_segment_*.seg | tail -n 1 | cut -f1; }
+./exfs2 -a /reclaim/huge.bin -f huge.bin
+disk_before=$(disk_kb)
+./exfs2 -r /reclaim/huge.bin
+[[ $(( disk_before - $(disk_kb) )) -ge 4096 ]]
+./exfs2 -T
+./exfs2 -a /reclaim/again.bin -f huge.bin
+./exfs2 -e /reclaim/again.bin | cmp - huge.bin
+./exfs2 -V && echo "✅ Reclaim test passed"
+
+# === Legacy image test (segments written by the original binary, no superblock) ===
+if root=$(git rev-list --max-parents=0 HEAD 2>/dev/null); then
+  echo "[test] Building the original binary and mounting an image it wrote..."
+  rm -rf legacy && mkdir -p legacy/src
+  git archive "$root" | tar -x -C legacy/src
+  make -s -C legacy/src exfs2 >/dev/null 2>&1
+  (
+    cd legacy
+    ./src/exfs2 -a /a/h.txt -f ../hello.txt 2>/dev/null
+    ./src/exfs2 -a /a/r.bin -f ../bigfile.bin 2>/dev/null
+    ./src/exfs2 -a /b/c.txt -f ../hello.txt 2>/dev/null
+    ../exfs2 -l 2>/dev/null | grep -q "|- c.txt"
+    ../exfs2 -a /b/new.bin -f ../bigfile.bin 2>/dev/null
+    ../exfs2 -e /a/r.bin 2>/dev/null | cmp - ../bigfile.bin
+    ../exfs2 -e /b/new.bin 2>/dev/null | cmp - ../bigfile.bin
+    ../exfs2 -e /a/h.txt 2>/dev/null | diff - ../hello.txt
+    # The last inode of a block-layout segment ends past the first 1MB of the file
+    head -c 4000 ../bigfile.bin > inline.bin
+    for i in $(seq 1 300); do echo "/many/f$i inline.bin"; done > manifest.txt
+    EXFS2_IO=mmap ../exfs2 -b manifest.txt 2>/dev/null
+    for i in $(seq 1 300); do
+      ../exfs2 -e /many/f$i 2>/dev/null | cmp - inline.bin
+      EXFS2_IO=mmap ../exfs2 -e /many/f$i 2>/dev/null | cmp - inline.bin
+    done
+  )
+  rm -rf legacy
+  echo "✅ Legacy image test passed"
+else
+  echo "[skip] Legacy image test needs the git history"
+fi
 
 # === Cleanup ===
 echo "[cleanup] Removing test artifacts..."
-rm -f hello.txt recovered.txt bigfile.bin recovered_big.bin huge.bin recovered_huge.bin
+rm -f hello.txt recovered.txt bigfile.bin recovered_big.bin huge.bin recovered_huge.bin \
+      giant.bin recovered_giant.bin manifest.txt log.txt sparse.bin holes.bin
 
 echo "[final] Listing filesystem contents..."
 ./exfs2 -l